@@ -1,201 +1,926 @@
 #include<bits/stdc++.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
+// Counts heap allocations while enabled, for the benchmark's bytes-allocated figures
+struct AllocationStats {
+    atomic<bool> enabled{false};
+    atomic<uint64_t> bytes{0};
+    atomic<uint64_t> count{0};
+};
+
+AllocationStats allocationStats;
+
+// Every form of operator new below allocates through here and every operator delete
+// releases with free(), so all heap traffic is counted and no form is paired with
+// another's deallocator. Returns nullptr when out of memory.
+void* countedAllocate(size_t size, size_t alignment = alignof(max_align_t)) {
+    if (allocationStats.enabled.load(memory_order_relaxed)) {
+        allocationStats.bytes.fetch_add(size, memory_order_relaxed);
+        allocationStats.count.fetch_add(1, memory_order_relaxed);
+    }
+    if (size == 0) {
+        size = 1;
+    }
+    if (alignment <= alignof(max_align_t)) {
+        return malloc(size);
+    }
+    void* memory = nullptr;
+    return posix_memalign(&memory, alignment, size) == 0 ? memory : nullptr;
+}
+
+void* countedAllocateOrThrow(size_t size, size_t alignment = alignof(max_align_t)) {
+    void* memory = countedAllocate(size, alignment);
+    if (memory == nullptr) {
+        throw bad_alloc();
+    }
+    return memory;
+}
+
+void* operator new(size_t size) {
+    return countedAllocateOrThrow(size);
+}
+
+void* operator new[](size_t size) {
+    return countedAllocateOrThrow(size);
+}
+
+void* operator new(size_t size, align_val_t alignment) {
+    return countedAllocateOrThrow(size, (size_t)alignment);
+}
+
+void* operator new[](size_t size, align_val_t alignment) {
+    return countedAllocateOrThrow(size, (size_t)alignment);
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept {
+    return countedAllocate(size);
+}
+
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+    return countedAllocate(size);
+}
+
+void* operator new(size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+    return countedAllocate(size, (size_t)alignment);
+}
+
+void* operator new[](size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+    return countedAllocate(size, (size_t)alignment);
+}
+
+void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    free(memory);
+}
 
-unordered_map<string, string> opcodeMap = {
-    {"add", "0110011"}, {"sub", "0110011"}, {"and", "0110011"}, {"or", "0110011"},
-    {"sll", "0110011"}, {"slt", "0110011"}, {"sra", "0110011"}, {"srl", "0110011"},
-    {"xor", "0110011"}, {"mul", "0110011"}, {"div", "0110011"}, {"rem", "0110011"},
-    {"addi", "0010011"}, {"andi", "0010011"}, {"ori", "0010011"}, {"jalr", "1100111"},
-    {"lb", "0000011"}, {"ld", "0000011"}, {"lh", "0000011"}, {"lw", "0000011"},
-    {"sb", "0100011"}, {"sw", "0100011"}, {"sd", "0100011"}, {"sh", "0100011"},
-    {"beq", "1100011"}, {"bne", "1100011"}, {"bge", "1100011"}, {"blt", "1100011"},
-    {"auipc", "0010111"}, {"lui", "0110111"}, {"jal", "1101111"}
+void operator delete[](void* memory, size_t) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, align_val_t) noexcept {
+    free(memory);
+}
+
+void operator delete[](void* memory, align_val_t) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, size_t, align_val_t) noexcept {
+    free(memory);
+}
+
+void operator delete[](void* memory, size_t, align_val_t) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, const nothrow_t&) noexcept {
+    free(memory);
+}
+
+void operator delete[](void* memory, const nothrow_t&) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, align_val_t, const nothrow_t&) noexcept {
+    free(memory);
+}
+
+void operator delete[](void* memory, align_val_t, const nothrow_t&) noexcept {
+    free(memory);
+}
+
+enum InstructionFormat { R_FORMAT, I_FORMAT, S_FORMAT, SB_FORMAT, U_FORMAT, UJ_FORMAT };
+
+enum Operation {
+    OP_ADD, OP_SUB, OP_AND, OP_OR, OP_SLL, OP_SLT, OP_SRA, OP_SRL, OP_XOR, OP_MUL, OP_DIV,
+    OP_REM, OP_ADDI, OP_ANDI, OP_ORI, OP_JALR, OP_LB, OP_LD, OP_LH, OP_LW, OP_SB, OP_SW, OP_SD,
+    OP_SH, OP_BEQ, OP_BNE, OP_BGE, OP_BLT, OP_AUIPC, OP_LUI, OP_JAL
 };
 
-unordered_map<string, string> funct3Map = {
-    {"add", "000"}, {"sub", "000"}, {"and", "111"}, {"or", "110"},
-    {"sll", "001"}, {"slt", "010"}, {"sra", "101"}, {"srl", "101"},
-    {"xor", "100"}, {"mul", "000"}, {"div", "100"}, {"rem", "110"},
-    {"addi", "000"}, {"andi", "111"}, {"ori", "110"}, {"jalr", "000"},
-    {"lb", "000"}, {"ld", "011"}, {"lh", "001"}, {"lw", "010"},
-    {"sb", "000"}, {"sw", "010"}, {"sd", "011"}, {"sh", "001"},
-    {"beq", "000"}, {"bne", "001"}, {"bge", "101"}, {"blt", "100"}
+struct InstructionInfo {
+    const char* name;
+    Operation operation;
+    InstructionFormat format;
+    uint8_t opcode;
+    uint8_t funct3;     // unused for U and UJ
+    uint8_t funct7;     // R format only
 };
 
-unordered_map<string, string> funct7Map = {
-    {"add", "0000000"}, {"sub", "0100000"}, {"sra", "0100000"}, {"srl", "0000000"},
-    {"mul", "0000001"}, {"div", "0000001"}, {"rem", "0000001"}
+constexpr InstructionInfo instructionTable[] = {
+    {"add", OP_ADD, R_FORMAT, 0b0110011, 0b000, 0b0000000}, {"sub", OP_SUB, R_FORMAT, 0b0110011, 0b000, 0b0100000},
+    {"and", OP_AND, R_FORMAT, 0b0110011, 0b111, 0b0000000}, {"or", OP_OR, R_FORMAT, 0b0110011, 0b110, 0b0000000},
+    {"sll", OP_SLL, R_FORMAT, 0b0110011, 0b001, 0b0000000}, {"slt", OP_SLT, R_FORMAT, 0b0110011, 0b010, 0b0000000},
+    {"sra", OP_SRA, R_FORMAT, 0b0110011, 0b101, 0b0100000}, {"srl", OP_SRL, R_FORMAT, 0b0110011, 0b101, 0b0000000},
+    {"xor", OP_XOR, R_FORMAT, 0b0110011, 0b100, 0b0000000}, {"mul", OP_MUL, R_FORMAT, 0b0110011, 0b000, 0b0000001},
+    {"div", OP_DIV, R_FORMAT, 0b0110011, 0b100, 0b0000001}, {"rem", OP_REM, R_FORMAT, 0b0110011, 0b110, 0b0000001},
+    {"addi", OP_ADDI, I_FORMAT, 0b0010011, 0b000, 0}, {"andi", OP_ANDI, I_FORMAT, 0b0010011, 0b111, 0},
+    {"ori", OP_ORI, I_FORMAT, 0b0010011, 0b110, 0}, {"jalr", OP_JALR, I_FORMAT, 0b1100111, 0b000, 0},
+    {"lb", OP_LB, I_FORMAT, 0b0000011, 0b000, 0}, {"ld", OP_LD, I_FORMAT, 0b0000011, 0b011, 0},
+    {"lh", OP_LH, I_FORMAT, 0b0000011, 0b001, 0}, {"lw", OP_LW, I_FORMAT, 0b0000011, 0b010, 0},
+    {"sb", OP_SB, S_FORMAT, 0b0100011, 0b000, 0}, {"sw", OP_SW, S_FORMAT, 0b0100011, 0b010, 0},
+    {"sd", OP_SD, S_FORMAT, 0b0100011, 0b011, 0}, {"sh", OP_SH, S_FORMAT, 0b0100011, 0b001, 0},
+    {"beq", OP_BEQ, SB_FORMAT, 0b1100011, 0b000, 0}, {"bne", OP_BNE, SB_FORMAT, 0b1100011, 0b001, 0},
+    {"bge", OP_BGE, SB_FORMAT, 0b1100011, 0b101, 0}, {"blt", OP_BLT, SB_FORMAT, 0b1100011, 0b100, 0},
+    {"auipc", OP_AUIPC, U_FORMAT, 0b0010111, 0, 0}, {"lui", OP_LUI, U_FORMAT, 0b0110111, 0, 0},
+    {"jal", OP_JAL, UJ_FORMAT, 0b1101111, 0, 0}
 };
 
-unordered_set<string> iFormatInstructions = {"addi", "andi", "ori", "lb", "ld", "lh", "lw", "jalr"};
+constexpr size_t INSTRUCTION_COUNT = sizeof(instructionTable) / sizeof(instructionTable[0]);
+constexpr size_t INSTRUCTION_SLOTS = 64;
+
+constexpr size_t mnemonicLength(const char* name) {
+    size_t len = 0;
+    while (name[len] != '\0') {
+        len++;
+    }
+    return len;
+}
 
-unordered_map<string, int> labelAddress;  // Stores label -> address mapping
-unordered_map<long, long> dataSegment;     // Stores data segment memory
-vector <pair<long, long>> sortedDataSegment; // Stores sorted data segment memory
+// Perfect hash over the mnemonics in instructionTable, only valid for len >= 2
+constexpr size_t instructionHash(const char* name, size_t len) {
+    return (len * 4 + (unsigned char)name[0] * 27 + (unsigned char)name[1] +
+            (unsigned char)name[len - 1]) & (INSTRUCTION_SLOTS - 1);
+}
 
-bool isIFormatInstruction(const string& inst) {
-    return iFormatInstructions.find(inst) != iFormatInstructions.end();
+constexpr array<int8_t, INSTRUCTION_SLOTS> buildInstructionSlots() {
+    array<int8_t, INSTRUCTION_SLOTS> slots{};
+    for (size_t i = 0; i < INSTRUCTION_SLOTS; i++) {
+        slots[i] = -1;
+    }
+    for (size_t i = 0; i < INSTRUCTION_COUNT; i++) {
+        const char* name = instructionTable[i].name;
+        slots[instructionHash(name, mnemonicLength(name))] = i;
+    }
+    return slots;
 }
 
-unordered_set<string> sFormatInstructions = {"sw", "sh", "sb", "sd"};
+constexpr array<int8_t, INSTRUCTION_SLOTS> instructionSlots = buildInstructionSlots();
 
-bool isSFormatInstruction(const string& inst) {
-    return sFormatInstructions.find(inst) != sFormatInstructions.end();
+constexpr bool instructionHashIsPerfect() {
+    for (size_t i = 0; i < INSTRUCTION_COUNT; i++) {
+        const char* name = instructionTable[i].name;
+        if (instructionSlots[instructionHash(name, mnemonicLength(name))] != (int8_t)i) {
+            return false;
+        }
+    }
+    return true;
 }
 
-unordered_set<string> sbFormatInstructions = {"beq", "bne", "bge", "blt"};
+static_assert(instructionHashIsPerfect(), "instructionHash has a collision, pick new multipliers");
+
+// Returns the descriptor for a mnemonic, or nullptr if it is not a supported instruction
+const InstructionInfo* findInstruction(string_view mnemonic) {
+    if (mnemonic.size() < 2) {
+        return nullptr;
+    }
+    int slot = instructionSlots[instructionHash(mnemonic.data(), mnemonic.size())];
+    if (slot < 0 || mnemonic != instructionTable[slot].name) {
+        return nullptr;
+    }
+    return &instructionTable[slot];
+}
 
-bool isSBFormatInstruction(const string& inst) {
-    return sbFormatInstructions.find(inst) != sbFormatInstructions.end();
+// The table is in Operation order, so expansions can name instructions as instructionTable[OP_X]
+constexpr bool instructionTableFollowsOperations() {
+    for (size_t i = 0; i < INSTRUCTION_COUNT; i++) {
+        if (instructionTable[i].operation != (Operation)i) {
+            return false;
+        }
+    }
+    return true;
 }
 
+static_assert(instructionTableFollowsOperations(), "instructionTable must list instructions in Operation order");
+
+enum PseudoKind { PSEUDO_NONE, PSEUDO_LI, PSEUDO_LA, PSEUDO_MV, PSEUDO_J, PSEUDO_RET, PSEUDO_CALL };
+
+struct PseudoInfo {
+    const char* name;
+    PseudoKind kind;
+    int labelOperand;    // position of the label among the operands, -1 if it takes none
+};
+
+constexpr PseudoInfo pseudoTable[] = {
+    {"li", PSEUDO_LI, -1}, {"la", PSEUDO_LA, 1}, {"mv", PSEUDO_MV, -1},
+    {"j", PSEUDO_J, 0}, {"ret", PSEUDO_RET, -1}, {"call", PSEUDO_CALL, 0}
+};
 
-int computeOffset(string label, int currentPC) {
-    if (labelAddress.find(label) == labelAddress.end()) {
-        cerr << "Error: Undefined label " << label << endl;
-        exit(1);
+// Only consulted once findInstruction() has failed, so a plain scan is enough
+const PseudoInfo* findPseudo(string_view mnemonic) {
+    for (const PseudoInfo& pseudo : pseudoTable) {
+        if (mnemonic == pseudo.name) {
+            return &pseudo;
+        }
     }
-    int labelAddr = labelAddress[label];
-    return labelAddr - currentPC;
+    return nullptr;
 }
 
-unordered_set<string> uFormatInstructions = {"auipc", "lui"};
+const long DATA_BASE = 0x10000000;
+
+// Data segment memory as one byte array starting at DATA_BASE. The directives only ever
+// append, so the bytes are kept in address order and never need sorting.
+class DataSegment {
+public:
+    void store(long address, uint8_t value) {
+        size_t offset = address - DATA_BASE;
+        if (offset >= bytes.size()) {
+            bytes.resize(offset + 1);
+        }
+        bytes[offset] = value;
+    }
+
+    // Stores the low size bytes of value, least significant byte first
+    void storeLittleEndian(long address, uint64_t value, int size) {
+        for (int i = 0; i < size; ++i) {
+            store(address + i, (value >> (8 * i)) & 0xFF);
+        }
+    }
+
+    const vector<uint8_t>& data() const {
+        return bytes;
+    }
+
+    void clear() {
+        bytes.clear();
+    }
+
+private:
+    vector<uint8_t> bytes;
+};
+
+struct Diagnostic {
+    string file;
+    int line;       // 1-based, 0 when the error is not tied to a line
+    int column;     // 1-based
+    string message;
+};
 
-bool isUFormatInstruction(const string& inst) {
-    return uFormatInstructions.find(inst) != uFormatInstructions.end();
+string formatDiagnostic(const Diagnostic& diagnostic) {
+    if (diagnostic.line == 0) {
+        return diagnostic.file + ": error: " + diagnostic.message;
+    }
+    return diagnostic.file + ":" + to_string(diagnostic.line) + ":" + to_string(diagnostic.column) +
+           ": error: " + diagnostic.message;
 }
 
-unordered_set<string> ujFormatInstructions = {"jal"};
+// Collects the errors of one source file. It also tracks the line currently being
+// processed, so the parsing helpers can report a position from just the offending token.
+class Diagnostics {
+public:
+    string file;
+    string_view currentLine;
+    int lineNumber = 0;
+
+    void setLine(string_view line, int number) {
+        currentLine = line;
+        lineNumber = number;
+    }
+
+    // where is a view into currentLine pointing at the offending text
+    void error(string_view where, const string& message) {
+        int column = 1;
+        if (where.data() >= currentLine.data() && where.data() <= currentLine.data() + currentLine.size()) {
+            column = where.data() - currentLine.data() + 1;
+        }
+        entries.push_back({file, lineNumber, column, message});
+    }
+
+    // An error about the file as a whole, such as one that cannot be read or written
+    void fileError(const string& message) {
+        entries.push_back({file, 0, 1, message});
+    }
+
+    void append(const Diagnostics& other) {
+        entries.insert(entries.end(), other.entries.begin(), other.entries.end());
+    }
+
+    // Orders by position, errors found by later fixups or parallel chunks end up in place
+    void sort() {
+        stable_sort(entries.begin(), entries.end(), [](const Diagnostic& a, const Diagnostic& b) {
+            return a.line != b.line ? a.line < b.line : a.column < b.column;
+        });
+    }
+
+    size_t count() const {
+        return entries.size();
+    }
+
+    void clear() {
+        entries.clear();
+        setLine(string_view(), 0);
+    }
+
+    vector<Diagnostic> entries;
+};
+
+// The phases from PHASE_TOKENIZE on are spent inside the ones before them
+enum StatsPhase {
+    PHASE_READ, PHASE_FIRST_PASS, PHASE_ENCODE, PHASE_DATA,
+    PHASE_TOKENIZE, PHASE_IMMEDIATES, PHASE_WRITE, PHASE_COUNT
+};
+
+const char* const phaseNames[PHASE_COUNT] = {"read", "first_pass", "encode", "data",
+                                             "tokenize", "immediates", "write"};
+const char* const formatNames[] = {"R", "I", "S", "SB", "U", "UJ"};
+
+// Counters filled in by assemblies when --stats is given. Atomic since parallel and batch
+// assemblies update them from several threads. The tokenize, immediates and write phases
+// are the time spent in nextToken(), parseImmediate() and output writes, which also
+// counts towards the phase making those calls.
+struct AssemblerStats {
+    array<atomic<uint64_t>, PHASE_COUNT> nanoseconds{};
+    array<atomic<uint64_t>, 6> instructions{};   // indexed by InstructionFormat
+    atomic<uint64_t> files{0};
+    atomic<uint64_t> lines{0};
+    atomic<uint64_t> labels{0};
+    atomic<uint64_t> dataBytes{0};
+    atomic<uint64_t> errors{0};
+    atomic<uint64_t> cacheHits{0};    // lines taken from the --incremental cache
+    atomic<uint64_t> cacheMisses{0};  // lines that had to be encoded
+    atomic<uint64_t> removed{0};      // instructions dropped by --optimize
+    uint64_t allocationBytes = 0;
+    uint64_t allocations = 0;
+};
+
+// Adds the time until it goes out of scope to one phase, does nothing without stats
+class PhaseTimer {
+public:
+    PhaseTimer(AssemblerStats* stats, StatsPhase phase) : stats(stats), phase(phase) {
+        if (stats != nullptr) {
+            start = chrono::steady_clock::now();
+        }
+    }
+
+    ~PhaseTimer() {
+        stop();
+    }
+
+    void stop() {
+        if (stats != nullptr) {
+            auto elapsed = chrono::steady_clock::now() - start;
+            stats->nanoseconds[phase] += chrono::duration_cast<chrono::nanoseconds>(elapsed).count();
+            stats = nullptr;
+        }
+    }
 
-bool isUJFormatInstruction(const string& inst) {
-    return ujFormatInstructions.find(inst) != ujFormatInstructions.end();
+private:
+    AssemblerStats* stats;
+    StatsPhase phase;
+    chrono::steady_clock::time_point start;
+};
+
+// Stats of the assembly running on this thread, for nextToken() and parseImmediate(),
+// which are called too deep to be handed the context. Null without --stats.
+thread_local AssemblerStats* threadStats = nullptr;
+
+// FNV-1a, continuing from hash when given
+uint64_t hashBytes(const void* bytes, size_t size, uint64_t hash = 14695981039346656037ull) {
+    const unsigned char* data = static_cast<const unsigned char*>(bytes);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
 }
 
-string registerToBinary(string reg) {
-    try {
-        int regNum = stoi(reg.substr(1));
-        if (regNum < 0 || regNum > 31) {
-            cerr << "Error: Register Out of range" << endl;
-            exit(1);
+// Bump allocator for everything that lives exactly as long as one assembly: the IR and
+// the symbol names. Memory is handed out from large blocks and only freed, all at once,
+// with the arena.
+class Arena {
+public:
+    void* allocate(size_t size, size_t align = alignof(max_align_t)) {
+        size_t offset = (used + align - 1) & ~(align - 1);
+        if (blocks.empty() || offset + size > blockSize) {
+            blockSize = max(BLOCK_SIZE, size);
+            blocks.emplace_back(new char[blockSize]);
+            firstBlockSize = blocks.size() == 1 ? blockSize : firstBlockSize;
+            offset = 0;
+        }
+        used = offset + size;
+        return blocks.back().get() + offset;
+    }
+
+    // Uninitialized storage, so T should be a plain struct
+    template <typename T>
+    T* allocateArray(size_t count) {
+        return static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+    }
+
+    string_view copy(string_view text) {
+        char* bytes = static_cast<char*>(allocate(text.size(), 1));
+        memcpy(bytes, text.data(), text.size());
+        return string_view(bytes, text.size());
+    }
+
+    // Frees everything at once but keeps the first block, so an arena reused for small
+    // assemblies stops allocating
+    void reset() {
+        if (!blocks.empty()) {
+            blocks.resize(1);
+            blockSize = firstBlockSize;
+        }
+        used = 0;
+    }
+
+private:
+    static constexpr size_t BLOCK_SIZE = 1 << 16;
+
+    vector<unique_ptr<char[]>> blocks;
+    size_t used = 0;
+    size_t blockSize = 0;
+    size_t firstBlockSize = 0;
+};
+
+struct Symbol {
+    string_view name;    // stored in the arena
+    int address;
+    bool defined;
+    int instruction;     // text labels in the IR: index of the instruction they point at
+    bool global;         // named by .globl, exported from --object output
+};
+
+// Interns label names into dense ids. Instructions refer to labels by id, so a label
+// defined after its use needs no second look at the source. Open addressing over
+// the id array keeps lookups free of per-entry allocations.
+class SymbolTable {
+public:
+    explicit SymbolTable(Arena& arena) : arena(arena), slots(64, -1) {}
+
+    // Id of name, adding it as undefined if it is new
+    int intern(string_view name) {
+        size_t slot = findSlot(name);
+        if (slots[slot] >= 0) {
+            return slots[slot];
+        }
+        int id = symbols.size();
+        symbols.push_back({arena.copy(name), 0, false, -1, false});
+        slots[slot] = id;
+        if (symbols.size() * 4 > slots.size() * 3) {
+            grow();
+        }
+        return id;
+    }
+
+    // The assemblers report a second definition of a label instead, see defineLabel()
+    void define(int id, int address, int instruction = -1) {
+        definedCount += !symbols[id].defined;
+        symbols[id].address = address;
+        symbols[id].defined = true;
+        symbols[id].instruction = instruction;
+    }
+
+    void setGlobal(int id) {
+        symbols[id].global = true;
+    }
+
+    // For relaxation, which moves text labels once they are defined
+    void setAddress(int id, int address) {
+        symbols[id].address = address;
+    }
+
+    // Id of name, or -1 if it has never been interned
+    int find(string_view name) const {
+        return slots[findSlot(name)];
+    }
+
+    const Symbol& operator[](int id) const {
+        return symbols[id];
+    }
+
+    size_t defined() const {
+        return definedCount;
+    }
+
+    size_t size() const {
+        return symbols.size();
+    }
+
+    // Forgets every symbol, keeping the memory for the next assembly. The names are in
+    // the arena, which has to be reset along with this.
+    void clear() {
+        slots.assign(64, -1);
+        symbols.clear();
+        definedCount = 0;
+    }
+
+private:
+    size_t findSlot(string_view name) const {
+        size_t mask = slots.size() - 1;
+        size_t slot = hashBytes(name.data(), name.size()) & mask;
+        while (slots[slot] >= 0 && symbols[slots[slot]].name != name) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    void grow() {
+        slots.assign(slots.size() * 2, -1);
+        for (size_t id = 0; id < symbols.size(); id++) {
+            slots[findSlot(symbols[id].name)] = id;
         }
-        return bitset<5>(regNum).to_string();
     }
-    catch (const invalid_argument& e) {
-        cerr << "Error: Invalid register format!" << endl;
-        exit(1);
+
+    Arena& arena;
+    vector<int> slots;
+    vector<Symbol> symbols;
+    size_t definedCount = 0;
+};
+
+const uint8_t NO_INSTRUCTION = 0xFF;
+
+// One text segment instruction after parsing. Registers and immediates are already
+// numeric, immediates as the bit pattern that goes into the word; only a label operand
+// is left to resolve.
+struct IrInstruction {
+    uint32_t lineOffset;    // the source line, as a span of Program::source
+    uint32_t lineLength;
+    int32_t lineNumber;
+    int32_t address;
+    uint32_t immediate;
+    int32_t symbol;         // branch or jal target label, -1 for a numeric offset
+    uint8_t instruction;    // index into instructionTable, NO_INSTRUCTION if unknown
+    uint8_t rd, rs1, rs2;
+    uint8_t pseudo;         // PSEUDO_LI or PSEUDO_LA, whose expansion encodeInstruction() builds
+    uint8_t words;          // machine words this line takes, after expansion and relaxation
+    uint8_t scratch;        // register a far j or branch jumps through, set by relaxBranches()
+    bool valid;             // false if parsing reported an error
+};
+
+// The text segment as filled in by firstPass(). The instruction array lives in the
+// context's arena.
+struct Program {
+    string_view source;
+    IrInstruction* instructions = nullptr;
+    size_t count = 0;
+    int endAddress = 0;
+
+    string_view line(const IrInstruction& ir) const {
+        return source.substr(ir.lineOffset, ir.lineLength);
     }
+};
+
+const int MAX_EXPANSION = 4;       // most machine words one line becomes, li 0x7FFFFFFF
+
+// One machine instruction of an expansion, operands resolved. The immediate is the bit
+// pattern for the format, for branches and jal the byte offset.
+struct MachineInstruction {
+    const InstructionInfo* info;
+    uint8_t rd, rs1, rs2;
+    uint32_t immediate;
+};
+
+bool fitsBranch(int64_t offset) {
+    return offset >= -4096 && offset <= 4094;
 }
 
-template <size_t N>
-bitset<N> parseImmediate(const std::string& imm) {
-    int value = 0; 
-
-    try{
-        if (imm.size() > 2 && imm[0] == '0') {
-            if (imm[1] == 'x' || imm[1] == 'X') {
-                // Hexadecimal
-                value = stoi(imm.substr(2), nullptr, 16);
-            } else if (imm[1] == 'b' || imm[1] == 'B') {
-                // Binary
-                value = stoi(imm.substr(2), nullptr, 2);
-            } else {
-                throw invalid_argument("Invalid immediate format!");
+bool fitsJal(int64_t offset) {
+    return offset >= -(1 << 20) && offset <= (1 << 20) - 2;
+}
+
+// auipc and jalr/addi halves of a 32-bit pc-relative offset, the low half sign-extended
+void splitOffset(int32_t offset, uint32_t& upper, uint32_t& lower) {
+    int32_t high = (int32_t)(((int64_t)offset + 0x800) >> 12);
+    upper = high & 0xFFFFF;
+    lower = (uint32_t)(offset - high * 4096) & 0xFFF;
+}
+
+// Shortest lui/addi sequence leaving value in rd. lui sign-extends on RV64, so values just
+// below 2^31 take lui 0x7FFFF followed by several addi.
+int loadImmediateSequence(int32_t value, uint8_t rd, MachineInstruction* out) {
+    const InstructionInfo* lui = &instructionTable[OP_LUI];
+    const InstructionInfo* addi = &instructionTable[OP_ADDI];
+    if (value >= -2048 && value <= 2047) {
+        out[0] = {addi, rd, 0, 0, (uint32_t)value & 0xFFF};
+        return 1;
+    }
+    int64_t high = ((int64_t)value + 0x800) >> 12;
+    if (high <= 0x7FFFF) {
+        int32_t low = value - (int32_t)(high * 4096);
+        out[0] = {lui, rd, 0, 0, (uint32_t)high & 0xFFFFF};
+        if (low == 0) {
+            return 1;
+        }
+        out[1] = {addi, rd, rd, 0, (uint32_t)low & 0xFFF};
+        return 2;
+    }
+    int count = 0;
+    int32_t rest = value - 0x7FFFF000;
+    out[count++] = {lui, rd, 0, 0, 0x7FFFF};
+    while (rest > 0) {
+        int32_t step = min(rest, 2047);
+        out[count++] = {addi, rd, rd, 0, (uint32_t)step};
+        rest -= step;
+    }
+    return count;
+}
+
+// The machine instructions one IR record stands for. offset is its resolved label offset
+// (label address minus ir.address), or its immediate when it has no label. A branch
+// relaxed to two words becomes the inverted branch over a jal, to three words the
+// inverted branch over auipc+jalr through ir.scratch. A relaxed jal becomes auipc+jalr
+// through rd, or ir.scratch for j.
+int expandInstruction(const IrInstruction& ir, uint32_t offset, MachineInstruction* out) {
+    const InstructionInfo& info = instructionTable[ir.instruction];
+    uint32_t upper, lower;
+    if (ir.pseudo == PSEUDO_LI) {
+        return loadImmediateSequence((int32_t)ir.immediate, ir.rd, out);
+    }
+    if (ir.pseudo == PSEUDO_LA) {
+        splitOffset(offset, upper, lower);
+        out[0] = {&instructionTable[OP_AUIPC], ir.rd, 0, 0, upper};
+        out[1] = {&instructionTable[OP_ADDI], ir.rd, ir.rd, 0, lower};
+        return 2;
+    }
+    if (info.format == SB_FORMAT && ir.words > 1) {
+        static const Operation inverse[] = {OP_BNE, OP_BEQ, OP_BLT, OP_BGE};   // of beq, bne, bge, blt
+        int32_t farOffset = (int32_t)offset - 4;   // from the instruction after the branch
+        out[0] = {&instructionTable[inverse[info.operation - OP_BEQ]], 0, ir.rs1, ir.rs2, 4u * ir.words};
+        if (ir.words == 2) {
+            out[1] = {&instructionTable[OP_JAL], 0, 0, 0, (uint32_t)farOffset};
+            return 2;
+        }
+        splitOffset(farOffset, upper, lower);
+        out[1] = {&instructionTable[OP_AUIPC], ir.scratch, 0, 0, upper};
+        out[2] = {&instructionTable[OP_JALR], 0, ir.scratch, 0, lower};
+        return 3;
+    }
+    if (info.format == UJ_FORMAT && ir.words > 1) {
+        uint8_t base = ir.rd != 0 ? ir.rd : ir.scratch;
+        splitOffset(offset, upper, lower);
+        out[0] = {&instructionTable[OP_AUIPC], base, 0, 0, upper};
+        out[1] = {&instructionTable[OP_JALR], ir.rd, base, 0, lower};
+        return 2;
+    }
+    out[0] = {&info, ir.rd, ir.rs1, ir.rs2, offset};
+    return 1;
+}
+
+// Everything one assembly run reads and writes, so several files can be assembled
+// side by side in one process.
+struct AssemblerContext {
+    Arena arena;
+    SymbolTable symbols{arena};               // text segment labels
+    DataSegment dataSegment;                  // Stores data segment memory
+    Program program;
+    Diagnostics diagnostics;
+    AssemblerStats* stats = nullptr;          // shared, only set with --stats
+    bool optimize = false;                    // run optimizeProgram() after the first pass
+    int scratchRegister = -1;                 // reserved by .scratch for far jumps, -1 if none
+
+    // Back to the state of a new context, keeping the memory of the last assembly for the
+    // next one, as --serve does between requests
+    void reset() {
+        symbols.clear();
+        arena.reset();
+        dataSegment.clear();
+        program = Program();
+        diagnostics.clear();
+        diagnostics.file.clear();
+        stats = nullptr;
+        optimize = false;
+        scratchRegister = -1;
+    }
+};
+
+// Parses a whole operand as a decimal, 0x hexadecimal or 0b binary integer with an
+// optional sign, in one scan and without allocating. Returns false on any other character,
+// with overflow set if the digits did not fit in a long long.
+bool parseInteger(string_view text, long long& value, bool& overflow) {
+    const char* p = text.data();
+    const char* end = p + text.size();
+    overflow = false;
+    bool negative = false;
+    if (p != end && (*p == '-' || *p == '+')) {
+        negative = *p++ == '-';
+    }
+    unsigned shift = 0;    // bits per digit for 0x and 0b, 0 for decimal
+    if (end - p > 2 && p[0] == '0') {
+        if (p[1] == 'x' || p[1] == 'X') {
+            shift = 4;
+        } else if (p[1] == 'b' || p[1] == 'B') {
+            shift = 1;
+        }
+        if (shift != 0) {
+            p += 2;
+        }
+    }
+    if (p == end) {
+        return false;
+    }
+    unsigned long long magnitude = 0;
+    for (; p != end; p++) {
+        unsigned digit;
+        char c = *p;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (shift == 4 && (c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            digit = (c | 0x20) - 'a' + 10;
+        } else {
+            return false;
+        }
+        if (shift == 0) {
+            if (magnitude > (ULLONG_MAX - digit) / 10) {
+                overflow = true;
             }
+            magnitude = magnitude * 10 + digit;
         } else {
-            value = stoi(imm);
+            if (digit >> shift != 0) {
+                return false;
+            }
+            if (magnitude >> (64 - shift) != 0) {
+                overflow = true;
+            }
+            magnitude = magnitude << shift | digit;
         }
     }
-    catch (const invalid_argument& e) {
-        cerr << "Error: Invalid immediate format!" << endl;
-        exit(1);
+    // Hex and binary may fill all 64 bits, so .dword 0xFFFFFFFFFFFFFFFF is -1
+    unsigned long long limit = shift != 0 ? ULLONG_MAX : negative ? 1ull << 63 : LLONG_MAX;
+    if (overflow || magnitude > limit) {
+        overflow = true;
+        return false;
+    }
+    value = negative ? (long long)(0 - magnitude) : (long long)magnitude;
+    return true;
+}
+
+// Register index for "xN" or an ABI name (zero, ra, sp, gp, tp, t0-t6, s0-s11, fp, a0-a7),
+// in one scan. Returns -1 if reg is neither, setting outOfRange for xN with N above 31.
+int parseRegister(string_view reg, bool& outOfRange) {
+    outOfRange = false;
+    if (reg.size() < 2) {
+        return -1;
+    }
+    // Digits after the first character, -1 if there are none, anything else, or too many
+    int number = 0;
+    for (size_t i = 1; i < reg.size() && number >= 0; i++) {
+        unsigned digit = reg[i] - '0';
+        number = digit > 9 || i > 3 ? -1 : number * 10 + digit;
+    }
+    switch (reg[0]) {
+        case 'x':
+            outOfRange = number > 31;
+            return number <= 31 ? number : -1;
+        case 'a':
+            return number >= 0 && number <= 7 ? 10 + number : -1;
+        case 't':
+            if (reg == "tp") {
+                return 4;
+            }
+            return number < 0 || number > 6 ? -1 : number < 3 ? 5 + number : 25 + number;
+        case 's':
+            if (reg == "sp") {
+                return 2;
+            }
+            return number < 0 || number > 11 ? -1 : number < 2 ? 8 + number : 16 + number;
+        case 'r':
+            return reg == "ra" ? 1 : -1;
+        case 'g':
+            return reg == "gp" ? 3 : -1;
+        case 'f':
+            return reg == "fp" ? 8 : -1;
+        case 'z':
+            return reg == "zero" ? 0 : -1;
+    }
+    return -1;
+}
+
+// Operands may be separated by commas as well as blanks, the tokenizer leaves them attached
+string_view stripTrailingComma(string_view operand) {
+    if (!operand.empty() && operand.back() == ',') {
+        operand.remove_suffix(1);
+    }
+    return operand;
+}
+
+// Returns the register index, or 0 after reporting an error
+int registerNumber(Diagnostics& diag, string_view reg) {
+    bool outOfRange;
+    int regNum = parseRegister(stripTrailingComma(reg), outOfRange);
+    if (regNum < 0) {
+        diag.error(reg, outOfRange ? "Register out of range" : "Invalid register format");
+        return 0;
+    }
+    return regNum;
+}
+
+// Returns the immediate as an N-bit pattern, or 0 after reporting an error
+template <size_t N>
+bitset<N> parseImmediate(Diagnostics& diag, string_view imm) {
+    PhaseTimer timer(threadStats, PHASE_IMMEDIATES);
+    long long value = 0;
+    bool overflow = false;
+    if (!parseInteger(stripTrailingComma(imm), value, overflow)) {
+        diag.error(imm, overflow ? "Immediate value out of range" : "Invalid immediate format");
+        return bitset<N>();
     }
 
     if (N == 12) {
         if (value < -2048 || value > 2047) {
-            cerr << "Error: Immediate value out of range!" << endl;
-            exit(1);
+            diag.error(imm, "Immediate value out of range");
+            return bitset<N>();
         }
     }
     if (N == 20) {
         if (value < 0 || value > 1048575) {
-            cerr << "Error: Immediate value out of range!" << endl;
-            exit(1);
+            diag.error(imm, "Immediate value out of range");
+            return bitset<N>();
         }
     }
     return bitset<N>(value);
 }
 
-string parseRFormat(string inst, string rd, string rs1, string rs2) {
-    return funct7Map[inst] + registerToBinary(rs2) + registerToBinary(rs1) + 
-           funct3Map[inst] + registerToBinary(rd) + opcodeMap[inst];
+// The encoders below pack each field straight into the 32-bit word.
+// Immediates are taken as raw bit patterns, only their low bits are used.
+uint32_t encodeRFormat(const InstructionInfo& info, uint32_t rd, uint32_t rs1, uint32_t rs2) {
+    return (uint32_t)info.funct7 << 25 | rs2 << 20 | rs1 << 15 | (uint32_t)info.funct3 << 12 |
+           rd << 7 | info.opcode;
 }
 
-string parseIFormat(string inst, string rd, string rs1, bitset<12> imm) {
-    return imm.to_string() + registerToBinary(rs1) + funct3Map[inst] +
-           registerToBinary(rd) + opcodeMap[inst];
+uint32_t encodeIFormat(const InstructionInfo& info, uint32_t rd, uint32_t rs1, uint32_t imm) {
+    return (imm & 0xFFF) << 20 | rs1 << 15 | (uint32_t)info.funct3 << 12 | rd << 7 | info.opcode;
 }
 
-string parseSFormat(string inst, string rs1, string rs2, bitset<12> imm_bin) {
-    string opcode = opcodeMap[inst];  
-    string funct3 = funct3Map[inst];
-
-    bitset<5> rs1_bin(registerToBinary(rs1));
-    bitset<5> rs2_bin(registerToBinary(rs2));
-
-    string machineCode = imm_bin.to_string().substr(0, 7) +  
-                         rs2_bin.to_string() +
-                         rs1_bin.to_string() +
-                         funct3 +
-                         imm_bin.to_string().substr(7) +
-                         opcode;
-
-    return machineCode;
+uint32_t encodeSFormat(const InstructionInfo& info, uint32_t rs1, uint32_t rs2, uint32_t imm) {
+    return (imm >> 5 & 0x7F) << 25 | rs2 << 20 | rs1 << 15 | (uint32_t)info.funct3 << 12 |
+           (imm & 0x1F) << 7 | info.opcode;
 }
 
-string parseSBFormat(string inst, string rs1, string rs2, bitset<13> offset) {
-    string opcode = opcodeMap[inst];  
-    string funct3 = funct3Map[inst];  
-
-    bitset<5> rs1_bin(registerToBinary(rs1));
-    bitset<5> rs2_bin(registerToBinary(rs2));
-
-    string machineCode = offset.to_string().substr(0, 1) +    
-                         offset.to_string().substr(2, 6) +    
-                         rs2_bin.to_string() + 
-                         rs1_bin.to_string() + 
-                         funct3 +
-                         offset.to_string().substr(8, 4) +    
-                         offset.to_string().substr(1, 1) +    
-                         opcode;
+// The scattered immediate bits of a branch for a 13-bit byte offset, bit 0 is implied
+uint32_t branchOffsetBits(uint32_t offset) {
+    return (offset >> 12 & 0x1) << 31 | (offset >> 5 & 0x3F) << 25 | (offset >> 1 & 0xF) << 8 |
+           (offset >> 11 & 0x1) << 7;
+}
 
-    return machineCode;
+// The same for jal and a 21-bit byte offset
+uint32_t jalOffsetBits(uint32_t offset) {
+    return (offset >> 20 & 0x1) << 31 | (offset >> 1 & 0x3FF) << 21 | (offset >> 11 & 0x1) << 20 |
+           (offset >> 12 & 0xFF) << 12;
 }
 
+uint32_t encodeSBFormat(const InstructionInfo& info, uint32_t rs1, uint32_t rs2, uint32_t offset) {
+    return branchOffsetBits(offset) | rs2 << 20 | rs1 << 15 | (uint32_t)info.funct3 << 12 | info.opcode;
+}
 
-string parseUFormat(string inst, string rd, bitset<20> imm_bin) {
-    string opcode = opcodeMap[inst];  
-    bitset<5> rd_bin(registerToBinary(rd));
+uint32_t encodeUFormat(const InstructionInfo& info, uint32_t rd, uint32_t imm) {
+    return (imm & 0xFFFFF) << 12 | rd << 7 | info.opcode;
+}
 
-    
-    string machineCode = imm_bin.to_string() + rd_bin.to_string() + opcode;
+uint32_t encodeUJFormat(const InstructionInfo& info, uint32_t rd, uint32_t offset) {
+    return jalOffsetBits(offset) | rd << 7 | info.opcode;
+}
 
-    return machineCode;
+string opcodeBits(const InstructionInfo& info) {
+    return bitset<7>(info.opcode).to_string();
 }
 
-string parseUJFormat(string inst, string rd, bitset<21> imm_bin) {
-    string opcode = opcodeMap[inst];  
-    bitset<5> rd_bin(registerToBinary(rd));
+string funct3Bits(const InstructionInfo& info) {
+    return bitset<3>(info.funct3).to_string();
+}
 
-    
-    string machineCode = imm_bin.to_string().substr(0, 1) +    
-                         imm_bin.to_string().substr(10, 10) +  
-                         imm_bin.to_string().substr(9, 1) +    
-                         imm_bin.to_string().substr(1, 8) +    
-                         rd_bin.to_string() + 
-                         opcode;
+string funct7Bits(const InstructionInfo& info) {
+    return bitset<7>(info.funct7).to_string();
+}
 
-    return machineCode;
+string registerBits(int reg) {
+    return bitset<5>(reg).to_string();
 }
 
 
@@ -246,323 +971,4174 @@ string formatBinaryInstruction(string opcode, string funct3, string funct7, stri
 }
 
 
-void firstPass(ifstream &inFile) {
-    string line, label, directive;
-    int address = 0;                
-    int dataAddress = 0x10000000;    
-    bool inTextSegment = true;       
-
-    while (getline(inFile, line)) {
-        size_t commentPos = line.find('#');
-        if (commentPos != string::npos) {
-            line = line.substr(0, commentPos);  
+// Read-only view of a source file. The file is mmapped where possible, so lines and
+// tokens can be handed out as string_views into it without copying anything.
+class SourceFile {
+public:
+    explicit SourceFile(const string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        opened = true;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                mapped = static_cast<char*>(data);
+                mappedSize = info.st_size;
+                madvise(data, mappedSize, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
+        if (mapped == nullptr) {
+            // Pipes and other files that can't be mapped are read into memory instead
+            ifstream inFile(path, ios::binary);
+            fallback.assign(istreambuf_iterator<char>(inFile), istreambuf_iterator<char>());
         }
+    }
 
-        if (line.empty()) {
-            continue; 
+    ~SourceFile() {
+        if (mapped != nullptr) {
+            munmap(mapped, mappedSize);
         }
-        istringstream iss(line);
-        string firstWord;
-        iss >> firstWord;
+    }
 
-        if (firstWord == ".text") {
-            inTextSegment = true;
-            continue;
-        } else if (firstWord == ".data") {
-            inTextSegment = false;
-            continue;
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+
+    bool isOpen() const {
+        return opened;
+    }
+
+    string_view text() const {
+        if (mapped != nullptr) {
+            return string_view(mapped, mappedSize);
         }
+        return fallback;
+    }
 
-        if (inTextSegment) {
-            if (firstWord.back() == ':') {
-                label = firstWord.substr(0, firstWord.size() - 1);
-                labelAddress[label] = address;
-                iss >> firstWord;
-                if (opcodeMap.find(firstWord) != opcodeMap.end()) {
-                    address += 4;
-                }
+private:
+    bool opened = false;
+    char* mapped = nullptr;
+    size_t mappedSize = 0;
+    string fallback;
+};
+
+// Splits the next line off the front of text, like getline
+bool nextLine(string_view& text, string_view& line) {
+    if (text.empty()) {
+        return false;
+    }
+    size_t end = text.find('\n');
+    if (end == string_view::npos) {
+        line = text;
+        text = string_view();
+    } else {
+        line = text.substr(0, end);
+        text.remove_prefix(end + 1);
+    }
+    return true;
+}
+
+bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+// Bit i of each mask is set when byte i of a 64-byte block is a newline or a '#'
+struct BlockMasks {
+    uint64_t newline;
+    uint64_t comment;
+};
+
+BlockMasks classifyBlockScalar(const char* block) {
+    BlockMasks masks = {0, 0};
+    for (int i = 0; i < 64; i++) {
+        masks.newline |= (uint64_t)(block[i] == '\n') << i;
+        masks.comment |= (uint64_t)(block[i] == '#') << i;
+    }
+    return masks;
+}
+
+#if defined(__x86_64__)
+BlockMasks classifyBlockSse2(const char* block) {
+    BlockMasks masks = {0, 0};
+    for (int lane = 0; lane < 4; lane++) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 16 * lane));
+        uint64_t newline = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')));
+        uint64_t comment = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('#')));
+        masks.newline |= newline << (16 * lane);
+        masks.comment |= comment << (16 * lane);
+    }
+    return masks;
+}
+
+__attribute__((target("avx2"))) BlockMasks classifyBlockAvx2(const char* block) {
+    BlockMasks masks = {0, 0};
+    for (int lane = 0; lane < 2; lane++) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + 32 * lane));
+        uint64_t newline = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n')));
+        uint64_t comment = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('#')));
+        masks.newline |= newline << (32 * lane);
+        masks.comment |= comment << (32 * lane);
+    }
+    return masks;
+}
+#endif
+
+using BlockClassifier = BlockMasks (*)(const char*);
+
+BlockClassifier bestBlockClassifier() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? classifyBlockAvx2 : classifyBlockSse2;
+#else
+    return classifyBlockScalar;
+#endif
+}
+
+// Picked once at startup, --bench-parsers swaps it to compare the variants
+BlockClassifier classifyBlock = bestBlockClassifier();
+
+// Splits a buffer into lines with their comment already cut off, like nextLine() followed
+// by stripComment(), but finds newlines and '#' together from the masks of 64-byte
+// blocks. The last partial block is classified from a zero-padded copy.
+class LineScanner {
+public:
+    explicit LineScanner(string_view text) : text(text) {}
+
+    bool next(string_view& line) {
+        if (position >= text.size()) {
+            return false;
+        }
+        size_t start = position;
+        size_t comment = string_view::npos;
+        size_t end = text.size();
+        for (size_t from = start; from < text.size();) {
+            size_t block = from / 64;
+            const BlockMasks& masks = masksOf(block);
+            uint64_t newlines = masks.newline >> (from % 64);
+            uint64_t comments = masks.comment >> (from % 64);
+            if (newlines != 0) {
+                comments &= (newlines & -newlines) - 1;   // only those before the newline
+            }
+            if (comment == string_view::npos && comments != 0) {
+                comment = from + __builtin_ctzll(comments);
+            }
+            if (newlines != 0) {
+                end = from + __builtin_ctzll(newlines);
+                break;
+            }
+            from = (block + 1) * 64;
+        }
+        position = end + 1;
+        line = text.substr(start, min(end, comment) - start);
+        return true;
+    }
+
+private:
+    const BlockMasks& masksOf(size_t block) {
+        if (block != cachedBlock) {
+            size_t offset = block * 64;
+            if (offset + 64 <= text.size()) {
+                cached = classifyBlock(text.data() + offset);
             } else {
-                address += 4;
+                char tail[64] = {};
+                memcpy(tail, text.data() + offset, text.size() - offset);
+                cached = classifyBlock(tail);
             }
-        } 
-        
-        else {
-            istringstream dataStream(line);
-            string varName, directive, value;
-            dataStream >> varName >> directive;
-
-            if (directive == ".byte") {
-                while (dataStream >> value) {
-                    dataSegment[dataAddress] = stoi(value);
-                    dataAddress += 1;
-                }
-            } 
-            else if (directive == ".half") {
-                while (dataStream >> value) {
-                    bitset<16> bits = parseImmediate<16>(value); 
-                    for (int i = 0; i < 2; ++i) {
-                        dataSegment[dataAddress + i] = (bits.to_ulong() >> (8 * i)) & 0xFF;
-                    }
-                    dataAddress += 2;
-                }
-            } 
-            else if (directive == ".word") {
-                while (dataStream >> value) {
-                    bitset<32> bits = parseImmediate<32>(value); 
-                    for (int i = 0; i < 4; ++i) {
-                        dataSegment[dataAddress + i] = (bits.to_ulong() >> (8 * i)) & 0xFF;
-                    }
-                    dataAddress += 4;
-                }
-            } 
-            else if (directive == ".dword") {
-                while (dataStream >> value) {
-                    bitset<64> bits = parseImmediate<64>(value); 
-                    for (int i = 0; i < 8; ++i) {
-                        dataSegment[dataAddress + i] = (bits.to_ullong() >> (8 * i)) & 0xFF;
-                    }
-                    dataAddress += 8;
+            cachedBlock = block;
+        }
+        return cached;
+    }
+
+    string_view text;
+    size_t position = 0;
+    size_t cachedBlock = SIZE_MAX;
+    BlockMasks cached;
+};
+
+// nextToken() without the vector fast path, kept for comparison in --bench-parsers
+string_view nextTokenScalar(string_view& rest) {
+    size_t start = 0;
+    while (start < rest.size() && isBlank(rest[start])) {
+        start++;
+    }
+    size_t end = start;
+    while (end < rest.size() && !isBlank(rest[end])) {
+        end++;
+    }
+    string_view token = rest.substr(start, end - start);
+    rest.remove_prefix(end);
+    return token;
+}
+
+// Splits the next whitespace separated token off the front of rest, like operator>>.
+// Returns an empty view once the line is used up.
+string_view nextToken(string_view& rest) {
+    PhaseTimer timer(threadStats, PHASE_TOKENIZE);
+#if defined(__x86_64__)
+    // Lines are short: when what is left fits in 32 bytes, one blank mask gives the token.
+    // Loads stay inside rest: past 16 bytes the second one ends at its last byte and
+    // overlaps the first, under 16 bytes rest is copied into a zero-padded block.
+    size_t size = rest.size();
+    if (size - 1 < 32) {
+        auto blankMask = [](const char* p) -> uint64_t {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            // \t \n \v \f \r are 9 to 13: byte - 9 is at most 4 when taken unsigned
+            __m128i offset = _mm_sub_epi8(bytes, _mm_set1_epi8(9));
+            __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(4)), offset);
+            __m128i blank = _mm_or_si128(control, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')));
+            return (uint16_t)_mm_movemask_epi8(blank);
+        };
+        uint64_t blanks;
+        if (size >= 16) {
+            blanks = blankMask(rest.data()) | blankMask(rest.data() + size - 16) << (size - 16);
+        } else {
+            char block[16] = {};
+            memcpy(block, rest.data(), size);
+            blanks = blankMask(block);
+        }
+        blanks |= ~0ULL << size;   // past the end counts as blank
+        uint64_t text = ~blanks;
+        size_t start = text != 0 ? __builtin_ctzll(text) : size;
+        size_t end = text != 0 ? start + __builtin_ctzll(blanks >> start) : size;
+        string_view token(rest.data() + start, end - start);
+        rest = string_view(rest.data() + end, size - end);
+        return token;
+    }
+#endif
+    return nextTokenScalar(rest);
+}
+
+string_view stripComment(string_view line) {
+    size_t commentPos = line.find('#');
+    if (commentPos != string_view::npos) {
+        line = line.substr(0, commentPos);
+    }
+    return line;
+}
+
+bool isNumericOperand(string_view operand) {
+    return !operand.empty() && (isdigit(operand[0]) || operand[0] == '-' || operand[0] == '+');
+}
+
+// Splits an "imm(rs1)" operand into its immediate and register parts
+void splitMemoryOperand(string_view operand, string_view& imm, string_view& rs1) {
+    size_t pos = operand.find('(');
+    imm = operand.substr(0, pos);
+    rs1 = operand.substr(pos + 1, operand.size() - pos - 2);
+}
+
+// Defines a text or data label. A label defined twice is an error and keeps its first
+// address, so the two-pass and one-pass assemblers resolve every use the same way.
+// Returns the label's id.
+int defineLabel(AssemblerContext& ctx, string_view label, int address, int instruction = -1) {
+    int id = ctx.symbols.intern(label);
+    if (ctx.symbols[id].defined) {
+        ctx.diagnostics.error(label, "Duplicate label " + string(label));
+    } else {
+        ctx.symbols.define(id, address, instruction);
+    }
+    return id;
+}
+
+void parseDataLine(AssemblerContext& ctx, string_view line, long& dataAddress) {
+    string_view rest = line;
+    string_view name = nextToken(rest);  // variable name
+    string_view directive = nextToken(rest);
+    if (!name.empty() && name.back() == ':') {
+        defineLabel(ctx, name.substr(0, name.size() - 1), dataAddress);
+    }
+    string_view value;
+
+    if (directive == ".byte") {
+        while (!(value = nextToken(rest)).empty()) {
+            bitset<8> bits = parseImmediate<8>(ctx.diagnostics, value);
+            ctx.dataSegment.store(dataAddress, bits.to_ulong());
+            dataAddress += 1;
+        }
+    } 
+    else if (directive == ".half") {
+        while (!(value = nextToken(rest)).empty()) {
+            bitset<16> bits = parseImmediate<16>(ctx.diagnostics, value); 
+            ctx.dataSegment.storeLittleEndian(dataAddress, bits.to_ulong(), 2);
+            dataAddress += 2;
+        }
+    } 
+    else if (directive == ".word") {
+        while (!(value = nextToken(rest)).empty()) {
+            bitset<32> bits = parseImmediate<32>(ctx.diagnostics, value); 
+            ctx.dataSegment.storeLittleEndian(dataAddress, bits.to_ulong(), 4);
+            dataAddress += 4;
+        }
+    } 
+    else if (directive == ".dword") {
+        while (!(value = nextToken(rest)).empty()) {
+            bitset<64> bits = parseImmediate<64>(ctx.diagnostics, value); 
+            ctx.dataSegment.storeLittleEndian(dataAddress, bits.to_ullong(), 8);
+            dataAddress += 8;
+        }
+    } 
+    else if (directive == ".asciz") {
+        // rest is ` "text"`, drop the separator and the quotes
+        string_view str = rest.size() >= 3 ? rest.substr(2, rest.size() - 3) : string_view();
+        for (char c : str) {
+            ctx.dataSegment.store(dataAddress, c);
+            dataAddress += 1;
+        }
+        ctx.dataSegment.store(dataAddress, 0);
+        dataAddress += 1;
+    }
+}
+
+// Returns the label operand of a branch or jal on this line, or an empty view if it has
+// none (other instructions, numeric offsets). A missing operand is an empty view at the
+// end of the line.
+string_view labelOperand(string_view line) {
+    string_view rest = line;
+    string_view inst = nextToken(rest);
+    string_view target;
+    if (!inst.empty() && inst.back() == ':') {
+        inst = nextToken(rest);
+    }
+    const InstructionInfo* info = findInstruction(inst);
+    const PseudoInfo* pseudo = info == nullptr ? findPseudo(inst) : nullptr;
+    int position = -1;
+    if (info != nullptr) {
+        position = info->format == SB_FORMAT ? 2 : info->format == UJ_FORMAT ? 1 : -1;
+    } else if (pseudo != nullptr) {
+        position = pseudo->labelOperand;
+    }
+    if (position < 0) {
+        return string_view();
+    }
+    for (int i = 0; i < position; i++) {
+        nextToken(rest);
+    }
+    target = nextToken(rest);
+    if (isNumericOperand(target)) {
+        return string_view();
+    }
+    return target;
+}
+
+// Operand of j, call and the branch formats: a numeric offset or a label to intern
+void parseTarget(SymbolTable& symbols, Diagnostics& diag, string_view offsetOrLabel, int bits, IrInstruction& ir) {
+    if (!isNumericOperand(offsetOrLabel)) {
+        ir.symbol = symbols.intern(offsetOrLabel);
+    } else if (bits == 13) {
+        ir.immediate = parseImmediate<13>(diag, offsetOrLabel).to_ulong();
+    } else {
+        ir.immediate = parseImmediate<21>(diag, offsetOrLabel).to_ulong();
+    }
+}
+
+// Pseudo-instructions are parsed into the instruction they stand for: mv is addi, j and
+// call are jal through x0 and ra, ret is jalr x0 ra 0. li and la keep their kind since
+// they expand to a sequence.
+void parsePseudoInstruction(SymbolTable& symbols, Diagnostics& diag, const PseudoInfo& pseudo,
+                            string_view rest, IrInstruction& ir) {
+    switch (pseudo.kind) {
+        case PSEUDO_LI: {
+            string_view rd = nextToken(rest);
+            string_view imm = nextToken(rest);
+            ir.rd = registerNumber(diag, rd);
+            int64_t value = parseImmediate<64>(diag, imm).to_ullong();
+            if (value != (int32_t)value) {
+                diag.error(imm, "Immediate value out of range");
+                value = 0;
+            }
+            MachineInstruction sequence[MAX_EXPANSION];
+            ir.instruction = OP_ADDI;
+            ir.pseudo = PSEUDO_LI;
+            ir.immediate = (uint32_t)value;
+            ir.words = loadImmediateSequence(value, ir.rd, sequence);
+            break;
+        }
+        case PSEUDO_LA: {
+            string_view rd = nextToken(rest);
+            string_view label = nextToken(rest);
+            ir.instruction = OP_AUIPC;
+            ir.pseudo = PSEUDO_LA;
+            ir.words = 2;
+            ir.rd = registerNumber(diag, rd);
+            ir.symbol = symbols.intern(label);
+            break;
+        }
+        case PSEUDO_MV: {
+            string_view rd = nextToken(rest);
+            string_view rs = nextToken(rest);
+            ir.instruction = OP_ADDI;
+            ir.rd = registerNumber(diag, rd);
+            ir.rs1 = registerNumber(diag, rs);
+            break;
+        }
+        case PSEUDO_J:
+        case PSEUDO_CALL:
+            ir.instruction = OP_JAL;
+            ir.rd = pseudo.kind == PSEUDO_CALL ? 1 : 0;
+            parseTarget(symbols, diag, nextToken(rest), 21, ir);
+            break;
+        case PSEUDO_RET:
+            ir.instruction = OP_JALR;
+            ir.rs1 = 1;
+            break;
+        case PSEUDO_NONE:
+            break;
+    }
+}
+
+// Parses one text segment line into ir, reporting errors to diag, which must already
+// point at this line. A label operand is interned in symbols. Returns false if the line
+// takes no instruction slot (a bare label). The caller fills in the line span, number
+// and address.
+bool parseInstruction(SymbolTable& symbols, Diagnostics& diag, string_view line, IrInstruction& ir) {
+    string_view rest = line;
+    string_view inst, rd, rs1, rs2;
+    string_view offsetOrLabel;
+    string_view imm;
+    size_t errorsBefore = diag.count();
+    inst = nextToken(rest);
+    if(inst.empty()){
+        return false;
+    }
+    if (inst.back() == ':') {
+        inst = nextToken(rest);
+        if (inst.empty() || inst.back() == ':') {
+            return false;
+        }
+    }
+    ir.rd = ir.rs1 = ir.rs2 = 0;
+    ir.immediate = 0;
+    ir.symbol = -1;
+    ir.pseudo = PSEUDO_NONE;
+    ir.words = 1;
+    ir.scratch = 0;
+    ir.valid = false;
+    const InstructionInfo* info = findInstruction(inst);
+    if (info == nullptr) {
+        const PseudoInfo* pseudo = findPseudo(inst);
+        if (pseudo == nullptr) {
+            diag.error(inst, "Invalid instruction: " + string(inst));
+            ir.instruction = NO_INSTRUCTION;
+            return true;
+        }
+        parsePseudoInstruction(symbols, diag, *pseudo, rest, ir);
+        ir.valid = diag.count() == errorsBefore;
+        return true;
+    }
+    ir.instruction = info - instructionTable;
+
+    switch (info->format) {
+        case R_FORMAT: {
+            rd = nextToken(rest);
+            rs1 = nextToken(rest);
+            rs2 = nextToken(rest);
+            ir.rd = registerNumber(diag, rd);
+            ir.rs1 = registerNumber(diag, rs1);
+            ir.rs2 = registerNumber(diag, rs2);
+            break;
+        }
+        case S_FORMAT: {
+            rs2 = nextToken(rest);
+            if (line.find('(') != string_view::npos) {  
+                // Parsing "sw rs2, imm(rs1)" format
+                splitMemoryOperand(nextToken(rest), imm, rs1);
+            } else {
+                // Parsing "sw rs2 imm rs1" format
+                imm = nextToken(rest);
+                rs1 = nextToken(rest);
+            }
+            ir.rs2 = registerNumber(diag, rs2);
+            ir.immediate = parseImmediate<12>(diag, imm).to_ulong();
+            ir.rs1 = registerNumber(diag, rs1);
+            break;
+        }
+        case SB_FORMAT: {
+            // BEQ, BNE, BLT, BGE
+            rs1 = nextToken(rest);
+            rs2 = nextToken(rest);
+            offsetOrLabel = nextToken(rest);
+            ir.rs1 = registerNumber(diag, rs1);
+            ir.rs2 = registerNumber(diag, rs2);
+            parseTarget(symbols, diag, offsetOrLabel, 13, ir);
+            break;
+        }
+        case I_FORMAT: {
+            rd = nextToken(rest);
+            if (info->opcode == 0b0000011) {
+                // Loads, support both "lw rd, imm(rs1)" and "lw rd imm rs1"
+                string_view immWithReg = nextToken(rest);
+                if (immWithReg.find('(') != string_view::npos) {
+                    splitMemoryOperand(immWithReg, imm, rs1);
+                } else {
+                    imm = immWithReg;
+                    rs1 = nextToken(rest);
                 }
-            } 
-            else if (directive == ".asciz") {
-                string str;
-                getline(dataStream, str);
-                int size = str.size();
-                str = str.substr(2, size - 3); 
-                for (char c : str) {
-                    dataSegment[dataAddress] = c;
-                    dataAddress += 1;
+            }
+            else if (info->opcode == 0b1100111) {
+                // jalr, support both "jalr rd, imm(rs1)" and "jalr rd, rs1, imm"
+                string_view immWithReg = nextToken(rest);
+                if (immWithReg.find('(') != string_view::npos) {
+                    splitMemoryOperand(immWithReg, imm, rs1);
+                } else {
+                    rs1 = immWithReg;  
+                    imm = nextToken(rest);
                 }
-                dataSegment[dataAddress] = 0; 
-                dataAddress += 1;
             }
+            else {
+                rs1 = nextToken(rest);
+                imm = nextToken(rest);
+            }
+            ir.rd = registerNumber(diag, rd);
+            ir.rs1 = registerNumber(diag, rs1);
+            ir.immediate = parseImmediate<12>(diag, imm).to_ulong();
+            break;
+        }
+        case U_FORMAT: {
+            rd = nextToken(rest);
+            imm = nextToken(rest);
+            ir.rd = registerNumber(diag, rd);
+            ir.immediate = parseImmediate<20>(diag, imm).to_ulong();
+            break;
+        }
+        case UJ_FORMAT: {
+            rd = nextToken(rest);
+            offsetOrLabel = nextToken(rest);
+            ir.rd = registerNumber(diag, rd);
+            parseTarget(symbols, diag, offsetOrLabel, 21, ir);
+            break;
         }
     }
+
+    ir.valid = diag.count() == errorsBefore;
+    return true;
 }
 
-void assemble(string inputFile, string outputFile) {
-    ifstream inFile(inputFile);
-    ofstream outFile(outputFile);
-    ifstream inFile2(inputFile);
-    firstPass(inFile2);
-    string line;
+// Lays the instructions out again from their word counts and moves the text labels along
+void assignAddresses(AssemblerContext& ctx) {
+    Program& program = ctx.program;
     int address = 0;
-    bool inTextSegment = true;
-    
-    
-    while (getline(inFile, line)) {
+    for (size_t i = 0; i < program.count; i++) {
+        program.instructions[i].address = address;
+        address += 4 * program.instructions[i].words;
+    }
+    program.endAddress = address;
+    for (size_t id = 0; id < ctx.symbols.size(); id++) {
+        int instruction = ctx.symbols[id].instruction;
+        if (instruction >= 0) {
+            ctx.symbols.setAddress(id, (size_t)instruction < program.count ? program.instructions[instruction].address
+                                                                          : address);
+        }
+    }
+}
+
+// Words a branch or jal needs to reach its label from where it is now (see
+// expandInstruction()), 0 if it is not one that relaxation touches. throughScratch is
+// set when that form jumps through the .scratch register: a branch beyond the reach of
+// jal, and a j beyond its own.
+int relaxedWords(const AssemblerContext& ctx, const IrInstruction& ir, bool& throughScratch) {
+    throughScratch = false;
+    if (ir.symbol < 0 || ir.words == 0 || ir.pseudo != PSEUDO_NONE || !ctx.symbols[ir.symbol].defined) {
+        return 0;
+    }
+    InstructionFormat format = instructionTable[ir.instruction].format;
+    int64_t offset = (int64_t)ctx.symbols[ir.symbol].address - ir.address;
+    if (format == SB_FORMAT && !fitsBranch(offset)) {
+        throughScratch = !fitsJal(offset - 4);
+        return throughScratch ? 3 : 2;
+    }
+    if (format == UJ_FORMAT && !fitsJal(offset)) {
+        throughScratch = ir.rd == 0;
+        return 2;
+    }
+    return 1;
+}
+
+// Grows every branch and jal whose label is out of reach into its longer form and
+// repeats until the layout stops changing, since growing one can push others out of
+// reach. Instructions never shrink, so this ends. Forms that need the .scratch register
+// are left alone without one, and reported once the layout is final.
+void relaxBranches(AssemblerContext& ctx) {
+    Program& program = ctx.program;
+    bool throughScratch;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 0; i < program.count; i++) {
+            IrInstruction& ir = program.instructions[i];
+            int words = relaxedWords(ctx, ir, throughScratch);
+            if (words > ir.words && (!throughScratch || ctx.scratchRegister >= 0)) {
+                ir.words = words;
+                ir.scratch = throughScratch ? ctx.scratchRegister : 0;
+                changed = true;
+            }
+        }
+        if (changed) {
+            assignAddresses(ctx);
+        }
+    }
+    for (size_t i = 0; i < program.count; i++) {
+        IrInstruction& ir = program.instructions[i];
+        if (relaxedWords(ctx, ir, throughScratch) > ir.words) {
+            string_view line = program.line(ir);
+            ctx.diagnostics.setLine(line, ir.lineNumber);
+            ctx.diagnostics.error(labelOperand(line), "Label " + string(ctx.symbols[ir.symbol].name) +
+                                  " out of range, reserve a register for far jumps with .scratch");
+            ir.valid = false;
+        }
+    }
+}
+
+int32_t signExtend12(uint32_t bits) {
+    return (int32_t)(bits << 20) >> 20;
+}
+
+bool isControlFlow(const IrInstruction& ir) {
+    const InstructionInfo& info = instructionTable[ir.instruction];
+    return info.format == SB_FORMAT || info.format == UJ_FORMAT || info.operation == OP_JALR;
+}
+
+bool isLoad(const IrInstruction& ir) {
+    return instructionTable[ir.instruction].opcode == 0b0000011;
+}
+
+bool readsRegister(const IrInstruction& ir, int reg) {
+    switch (instructionTable[ir.instruction].format) {
+        case R_FORMAT:
+        case S_FORMAT:
+        case SB_FORMAT:
+            return ir.rs1 == reg || ir.rs2 == reg;
+        case I_FORMAT:
+            return ir.rs1 == reg;
+        default:
+            return false;
+    }
+}
+
+bool writesRegister(const IrInstruction& ir, int reg) {
+    InstructionFormat format = instructionTable[ir.instruction].format;
+    return format != S_FORMAT && format != SB_FORMAT && ir.rd == reg;
+}
+
+// ".scratch reg" reserves reg for the far jumps relaxBranches() builds, which overwrite
+// it. It has to come before the first instruction, so that every use of the register
+// can be reported as its line is parsed, in --one-pass as well.
+void parseScratchDirective(AssemblerContext& ctx, string_view rest, bool afterInstructions) {
+    Diagnostics& diag = ctx.diagnostics;
+    string_view name = nextToken(rest);
+    size_t errorsBefore = diag.count();
+    int reg = registerNumber(diag, name);
+    if (diag.count() != errorsBefore) {
+        return;
+    }
+    if (afterInstructions) {
+        diag.error(diag.currentLine, ".scratch must come before the first instruction");
+    } else if (reg == 0) {
+        diag.error(name, "x0 cannot be the scratch register");
+    } else {
+        ctx.scratchRegister = reg;
+    }
+}
+
+// Reports a parsed instruction that uses the register reserved by .scratch
+void checkScratchUse(AssemblerContext& ctx, const IrInstruction& ir, string_view line) {
+    int reg = ctx.scratchRegister;
+    if (reg >= 0 && ir.instruction != NO_INSTRUCTION && (readsRegister(ir, reg) || writesRegister(ir, reg))) {
+        ctx.diagnostics.error(line, "Register x" + to_string(reg) + " is reserved for far jumps by .scratch");
+    }
+}
+
+// Instructions with no effect: any write to x0 except jumps and loads (which may fault),
+// and identities such as addi xN xN 0, or xN xN x0 and and xN xN xN
+bool isNoOp(const IrInstruction& ir) {
+    const InstructionInfo& info = instructionTable[ir.instruction];
+    if (isControlFlow(ir) || isLoad(ir) || info.format == S_FORMAT) {
+        return false;
+    }
+    if (ir.rd == 0) {
+        return true;
+    }
+    if (ir.pseudo != PSEUDO_NONE || ir.rd != ir.rs1) {
+        return false;
+    }
+    switch (info.operation) {
+        case OP_ADDI:
+        case OP_ORI:
+            return signExtend12(ir.immediate) == 0;
+        case OP_ANDI:
+            return signExtend12(ir.immediate) == -1;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_XOR:
+        case OP_SLL:
+        case OP_SRA:
+        case OP_SRL:
+            return ir.rs2 == 0;
+        case OP_AND:
+        case OP_OR:
+            return ir.rs2 == 0 || ir.rs2 == ir.rd;
+        default:
+            return false;
+    }
+}
+
+bool isAddiOn(const IrInstruction& ir, int reg) {
+    return ir.valid && ir.pseudo == PSEUDO_NONE && ir.instruction == OP_ADDI && ir.rd == reg && ir.rs1 == reg;
+}
+
+// First instruction at or after index that is still in the program
+size_t nextLive(const Program& program, size_t index) {
+    while (index < program.count && program.instructions[index].words == 0) {
+        index++;
+    }
+    return index;
+}
 
-        size_t commentPos = line.find('#');
-        if (commentPos != string::npos) {
-            line = line.substr(0, commentPos);  
+// Moves addi xN xN a at index forward onto the next addi xN xN b in the same basic block,
+// which then adds a+b, or goes as well if that is 0. Loads and stores in between using xN
+// as their base get a added to their offset. Anything else reading or writing xN, a
+// label or a jump ends the search.
+bool foldAddi(Program& program, const vector<char>& labelled, size_t index, vector<size_t>& adjusted) {
+    IrInstruction& first = program.instructions[index];
+    int reg = first.rd;
+    int32_t amount = signExtend12(first.immediate);
+    adjusted.clear();
+    for (size_t j = index + 1; j < program.count; j++) {
+        IrInstruction& ir = program.instructions[j];
+        if (labelled[j] || !ir.valid || ir.instruction == NO_INSTRUCTION) {
+            return false;
         }
-        if (line.empty()) {
+        if (ir.words == 0) {
             continue;
         }
+        if (isAddiOn(ir, reg)) {
+            int32_t sum = amount + signExtend12(ir.immediate);
+            if (sum < -2048 || sum > 2047) {
+                return false;
+            }
+            for (size_t k : adjusted) {
+                IrInstruction& memory = program.instructions[k];
+                memory.immediate = (uint32_t)(signExtend12(memory.immediate) + amount) & 0xFFF;
+            }
+            ir.immediate = (uint32_t)sum & 0xFFF;
+            first.words = 0;
+            if (sum == 0) {
+                ir.words = 0;
+            }
+            return true;
+        }
+        if (isControlFlow(ir) || writesRegister(ir, reg)) {
+            return false;
+        }
+        if (readsRegister(ir, reg)) {
+            bool base = ir.pseudo == PSEUDO_NONE && (isLoad(ir) || instructionTable[ir.instruction].format == S_FORMAT) &&
+                        ir.rs1 == reg && (isLoad(ir) || ir.rs2 != reg);
+            int32_t offset = signExtend12(ir.immediate) + amount;
+            if (!base || offset < -2048 || offset > 2047) {
+                return false;
+            }
+            adjusted.push_back(j);
+        }
+    }
+    return false;
+}
 
-        istringstream iss(line);
-        istringstream iss2(line);
-        string firstWord;
-        iss2 >> firstWord;
-        
-        if (firstWord == ".text") {
-            inTextSegment = true;
-            continue;  
-        } else if (firstWord == ".data") {
-            inTextSegment = false;
-            continue;  
+// Gives every branch and jal with a numeric offset a synthetic label on its target, so
+// the offset follows the code when instructions are removed. Returns false if some
+// target is not the start of an instruction, the program uses auipc directly, or some
+// jalr may land anywhere but an address the code itself produced: such code depends on
+// its layout and must not be changed. A jalr is only trusted with no offset and a base
+// register that nothing but jal, jalr and la ever writes, so it always returns to a
+// link address or jumps to a label.
+bool labelNumericTargets(AssemblerContext& ctx) {
+    Program& program = ctx.program;
+    uint32_t computed = 0;      // registers written by anything but jal, jalr and la
+    for (size_t i = 0; i < program.count; i++) {
+        const IrInstruction& ir = program.instructions[i];
+        if (!ir.valid || ir.instruction == NO_INSTRUCTION) {
+            continue;
         }
-        if (inTextSegment == false) {
+        if (ir.instruction == OP_AUIPC && ir.pseudo == PSEUDO_NONE) {
+            return false;
+        }
+        InstructionFormat format = instructionTable[ir.instruction].format;
+        bool link = ir.instruction == OP_JAL || ir.instruction == OP_JALR || ir.pseudo == PSEUDO_LA;
+        if (format != S_FORMAT && format != SB_FORMAT && !link) {
+            computed |= 1u << ir.rd;
+        }
+    }
+    for (size_t i = 0; i < program.count; i++) {
+        const IrInstruction& ir = program.instructions[i];
+        if (ir.valid && ir.instruction == OP_JALR &&
+            (ir.rs1 == 0 || (ir.immediate & 0xfff) != 0 || (computed >> ir.rs1 & 1))) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < program.count; i++) {
+        IrInstruction& ir = program.instructions[i];
+        if (!ir.valid || ir.symbol >= 0 || ir.pseudo != PSEUDO_NONE || ir.instruction == NO_INSTRUCTION) {
             continue;
         }
-        string inst, rd, rs1, rs2;
-        string formatedInstruction;
-        string offsetOrLabel;
-        string imm;
-        iss >> inst;
-        if(inst.empty()){
+        InstructionFormat format = instructionTable[ir.instruction].format;
+        if (format != SB_FORMAT && format != UJ_FORMAT) {
             continue;
         }
-        if (inst.back() == ':') {
-            iss >> inst;
-        }
-        if (opcodeMap.find(inst) != opcodeMap.end()) {
-            if (funct3Map.find(inst) != funct3Map.end()) {
-                if (funct7Map.find(inst) != funct7Map.end()) {  
-                    // R-Type instruction
-                    iss >> rd >> rs1 >> rs2;
-                    bitset<32> machineCode(parseRFormat(inst, rd, rs1, rs2)); 
-                    formatedInstruction = formatBinaryInstruction(
-                        opcodeMap[inst], funct3Map[inst], funct7Map[inst], 
-                        registerToBinary(rd), registerToBinary(rs1), registerToBinary(rs2), ""
-                    );
-                    outFile << "0x" << hex << address << " 0x" 
-                            << setw(8) << setfill('0') << stoul(machineCode.to_string(), nullptr, 2)
-                            << " , " << line << " # " << formatedInstruction << endl;
-                } 
-                else {  
-                    if (isSFormatInstruction(inst)) {  
-                        // S-Type instruction
-                        char temp;
-                        if (line.find('(') != string::npos) {  
-                            // Parsing "sw rs2, imm(rs1)" format
-                            string immWithReg;
-                            iss >> rs2 >> immWithReg;
-                            
-                            size_t pos = immWithReg.find('(');
-                            imm = immWithReg.substr(0, pos);  
-                            rs1 = immWithReg.substr(pos + 1, immWithReg.size() - pos - 2); 
-                        } else {
-                            // Parsing "sw rs2 imm rs1" format
-                            iss >> rs2 >> imm >> rs1;
-                        }
-                        bitset<12> immediate = parseImmediate<12>(imm);
-                        bitset<32> machineCode(parseSFormat(inst, rs1, rs2, immediate));
-        
-                        formatedInstruction = formatBinaryInstruction(
-                            opcodeMap[inst], funct3Map[inst], "", "", 
-                            registerToBinary(rs1), registerToBinary(rs2), 
-                            immediate.to_string()
-                        );
-        
-                        outFile << "0x" << hex << address << " 0x" 
-                                << setw(8) << setfill('0') << stoul(machineCode.to_string(), nullptr, 2)
-                                << " , " << line << " # " << formatedInstruction << endl;
-                    } 
-                    else if (isSBFormatInstruction(inst)) {  
-                        // SB-Type instruction (BEQ, BNE, BLT, BGE)
-                        iss >> rs1 >> rs2 >> offsetOrLabel;
-                        bitset<13> offset;
-                    
-                        if (isdigit(offsetOrLabel[0]) || offsetOrLabel[0] == '-' || offsetOrLabel[0] == '+') {
-                            offset = parseImmediate<13>(offsetOrLabel);  
-                        } else {
-                            offset = bitset<13>(computeOffset(offsetOrLabel, address));  
-                        }
-                    
-                        offset &= ~bitset<13>(3);  
-                        
-                        bitset<32> machineCode(parseSBFormat(inst, rs1, rs2, offset));
-                    
-                        formatedInstruction = formatBinaryInstruction(
-                            opcodeMap[inst], funct3Map[inst], "", "", 
-                            registerToBinary(rs1), registerToBinary(rs2), offset.to_string()
-                        );
-                    
-                        outFile << "0x" << hex << address << " 0x" 
-                                << setw(8) << setfill('0') << stoul(machineCode.to_string(), nullptr, 2)
-                                << " , " << line << " # " << formatedInstruction << endl;
-                    } 
-                    else if (isIFormatInstruction(inst)) {  
-                        // I-Type instruction
-                        if (inst == "lw" || inst == "lb" || inst == "ld" || inst == "lh") {
-                            // Support both "lw rd, imm(rs1)" and "lw rd imm rs1"
-                            string immWithReg;
-                            iss >> rd >> immWithReg;
-                    
-                            if (immWithReg.find('(') != string::npos) {
-                                // Handling "lw rd, imm(rs1)" format
-                                size_t pos = immWithReg.find('(');
-                                imm = immWithReg.substr(0, pos); 
-                                rs1 = immWithReg.substr(pos + 1, immWithReg.size() - pos - 2); 
-                            } else {
-                                // Handling "lw rd imm rs1" format
-                                imm = immWithReg;
-                                iss >> rs1;      
-                            }
-                        }
-                        else if (inst == "jalr") {
-                            // Support both "jalr rd, imm(rs1)" and "jalr rd, rs1, imm"
-                            string immWithReg;
-                            iss >> rd >> immWithReg;
-                        
-                            if (immWithReg.find('(') != string::npos) {
-
-                                size_t pos = immWithReg.find('(');
-                                imm = immWithReg.substr(0, pos);  
-                                rs1 = immWithReg.substr(pos + 1, immWithReg.size() - pos - 2);  
-                            } else {
-
-                                rs1 = immWithReg;  
-                                iss >> imm;        
-                            }
-                        }
-                        else {
-
-                            iss >> rd >> rs1 >> imm;
-                        }
-                        bitset<12> immediate = (parseImmediate<12>(imm));
-                        bitset<32> machineCode(parseIFormat(inst, rd, rs1, immediate));
-        
-                        formatedInstruction = formatBinaryInstruction(
-                            opcodeMap[inst], funct3Map[inst], "", 
-                            registerToBinary(rd), registerToBinary(rs1), "", 
-                            immediate.to_string()
-                        );
-        
-                        outFile << "0x" << hex << address << " 0x" 
-                                << setw(8) << setfill('0') << stoul(machineCode.to_string(), nullptr, 2)
-                                << " , " << line << " # " << formatedInstruction << endl;
-                    }
+        int bits = format == SB_FORMAT ? 13 : 21;
+        int64_t target = ir.address + ((int32_t)(ir.immediate << (32 - bits)) >> (32 - bits) & ~3LL);
+        auto it = lower_bound(program.instructions, program.instructions + program.count, target,
+                              [](const IrInstruction& a, int64_t address) { return a.address < address; });
+        size_t index = it - program.instructions;
+        if (target != (index < program.count ? it->address : program.endAddress)) {
+            return false;
+        }
+        // Labels never contain blanks, so these names cannot clash with real ones
+        int symbol = ctx.symbols.intern(" " + to_string(index));
+        ctx.symbols.define(symbol, target, index);
+        ir.symbol = symbol;
+    }
+    return true;
+}
+
+// --optimize: peephole pass over the IR between label resolution and encoding. Removes
+// no-ops and writes to x0, folds addi chains on one register, threads jumps to jumps and
+// drops branches to the next instruction, until none of these applies. Removed
+// instructions keep their record with no words, and labels are moved afterwards.
+void optimizeProgram(AssemblerContext& ctx) {
+    Program& program = ctx.program;
+    if (!labelNumericTargets(ctx)) {
+        return;
+    }
+    vector<char> labelled(program.count + 1, 0);
+    for (size_t id = 0; id < ctx.symbols.size(); id++) {
+        if (ctx.symbols[id].instruction >= 0) {
+            labelled[ctx.symbols[id].instruction] = 1;
+        }
+    }
+    // Index of the instruction a text label currently lands on, -1 for other symbols
+    auto targetOf = [&](const IrInstruction& ir) -> long {
+        if (ir.symbol < 0 || ctx.symbols[ir.symbol].instruction < 0) {
+            return -1;
+        }
+        return nextLive(program, ctx.symbols[ir.symbol].instruction);
+    };
+
+    vector<size_t> adjusted;
+    size_t removed = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 0; i < program.count; i++) {
+            IrInstruction& ir = program.instructions[i];
+            if (ir.words == 0 || !ir.valid || ir.instruction == NO_INSTRUCTION) {
+                continue;
+            }
+            if (isNoOp(ir)) {
+                ir.words = 0;
+                changed = true;
+                continue;
+            }
+            if (isAddiOn(ir, ir.rd) && foldAddi(program, labelled, i, adjusted)) {
+                changed = true;
+                continue;
+            }
+            if (!isControlFlow(ir) || ir.instruction == OP_JALR) {
+                continue;
+            }
+            // A jump or branch to a plain jump goes straight to where that one leads
+            for (int hops = 0; hops < 8; hops++) {
+                long target = targetOf(ir);
+                if (target < 0 || (size_t)target >= program.count || (size_t)target == i) {
+                    break;
                 }
+                const IrInstruction& next = program.instructions[target];
+                if (next.instruction != OP_JAL || next.rd != 0 || targetOf(next) < 0 || next.symbol == ir.symbol) {
+                    break;
+                }
+                ir.symbol = next.symbol;
+                changed = true;
+            }
+            bool jumpsOnly = instructionTable[ir.instruction].format == SB_FORMAT || ir.rd == 0;
+            if (jumpsOnly && targetOf(ir) == (long)nextLive(program, i + 1)) {
+                ir.words = 0;
+                changed = true;
             }
-            else if (isUFormatInstruction(inst)) {  
+        }
+    }
+    for (size_t i = 0; i < program.count; i++) {
+        removed += program.instructions[i].words == 0 && program.instructions[i].instruction != NO_INSTRUCTION;
+    }
+    if (ctx.stats != nullptr) {
+        ctx.stats->removed += removed;
+    }
+    assignAddresses(ctx);
+}
 
-                iss >> rd >> imm;
-                bitset<20> immediate = (parseImmediate<20>(imm));
-                bitset<32> machineCode(parseUFormat(inst, rd, immediate));
+// Records every label address, fills the data segment and parses the text segment into
+// ctx.program, then relaxes out of range branches. Returns the address following the
+// last instruction.
+int firstPass(AssemblerContext& ctx, string_view source) {
+    PhaseTimer timer(ctx.stats, PHASE_FIRST_PASS);
+    Program& program = ctx.program;
+    // Instructions are one per line, so the line count bounds the array
+    size_t maxInstructions = count(source.begin(), source.end(), '\n') + 1;
+    program.source = source;
+    program.instructions = ctx.arena.allocateArray<IrInstruction>(maxInstructions);
+    program.count = 0;
+    LineScanner lines(source);
+    string_view line;
+    int lineNumber = 0;
+    int address = 0;                
+    long dataAddress = DATA_BASE;
+    bool inTextSegment = true;       
 
-                formatedInstruction = formatBinaryInstruction(
-                    opcodeMap[inst], "", "", registerToBinary(rd), "", "", immediate.to_string()
-                );
+    while (lines.next(line)) {
+        lineNumber++;
+        ctx.diagnostics.setLine(line, lineNumber);
+        string_view rest = line;
+        string_view firstWord = nextToken(rest);
+        if (firstWord.empty()) {
+            continue;
+        }
 
-                outFile << "0x" << hex << address << " 0x" 
-                        << setw(8) << setfill('0') << stoul(machineCode.to_string(), nullptr, 2)
-                        << " , " << line << " # " << formatedInstruction << endl;
+        if (firstWord == ".text") {
+            inTextSegment = true;
+            continue;
+        } else if (firstWord == ".data") {
+            inTextSegment = false;
+            continue;
+        } else if (firstWord == ".globl" || firstWord == ".global") {
+            for (string_view name; !(name = nextToken(rest)).empty();) {
+                ctx.symbols.setGlobal(ctx.symbols.intern(name));
             }
-            else if (isUJFormatInstruction(inst)) {  
+            continue;
+        } else if (firstWord == ".scratch") {
+            parseScratchDirective(ctx, rest, address > 0);
+            continue;
+        }
 
-                iss >> rd >> offsetOrLabel;
-                bitset<21> offset;
-                if (isdigit(offsetOrLabel[0]) || offsetOrLabel[0] == '-' || offsetOrLabel[0] == '+') {
-                    offset = parseImmediate<21>(offsetOrLabel);  
-                } else {
-                    offset = bitset<21>(computeOffset(offsetOrLabel, address));  
+        if (inTextSegment) {
+            if (firstWord.back() == ':') {
+                defineLabel(ctx, firstWord.substr(0, firstWord.size() - 1), address, program.count);
+            }
+            IrInstruction& ir = program.instructions[program.count];
+            if (parseInstruction(ctx.symbols, ctx.diagnostics, line, ir)) {
+                checkScratchUse(ctx, ir, line);
+                ir.lineOffset = line.data() - program.source.data();
+                ir.lineLength = line.size();
+                ir.lineNumber = lineNumber;
+                ir.address = address;
+                program.count++;
+                address += 4 * ir.words;
+                if (ctx.stats != nullptr && ir.instruction != NO_INSTRUCTION) {
+                    ctx.stats->instructions[instructionTable[ir.instruction].format]++;
                 }
-
-                offset &= ~bitset<21>(3);  
-                bitset<32> machineCode(parseUJFormat(inst, rd, offset));
-            
-                formatedInstruction = formatBinaryInstruction(
-                    opcodeMap[inst], "", "", registerToBinary(rd), "", "", (offset).to_string()
-                );
-            
-                outFile << "0x" << hex << address << " 0x" 
-                        << setw(8) << setfill('0') << stoul(machineCode.to_string(), nullptr, 2)
-                        << " , " << line << " # " << formatedInstruction << endl;
             }
-            
-            address += 4;  
+        } 
+        
+        else {
+            parseDataLine(ctx, line, dataAddress);
         }
-        else if(inst.back() != ':') {
-            cout << "Invalid instruction: " << inst << endl;
-            exit(1);
-            break;
+    }
+    if (ctx.stats != nullptr) {
+        ctx.stats->lines += lineNumber;
+        ctx.stats->labels += ctx.symbols.defined();
+    }
+    program.endAddress = address;
+    if (ctx.optimize) {
+        optimizeProgram(ctx);
+    }
+    relaxBranches(ctx);
+    return program.endAddress;
+}
+
+// Thread pool where every worker owns a deque of tasks. A worker takes new work from the
+// back of its own deque and, once that is empty, steals from the front of the others.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(unsigned threadCount) {
+        threadCount = max(1u, threadCount);
+        for (unsigned i = 0; i < threadCount; i++) {
+            workers.push_back(make_unique<Worker>());
+        }
+        for (unsigned i = 0; i < threadCount; i++) {
+            threads.emplace_back([this, i] { run(i); });
         }
     }
-    outFile << "0x" << hex << address << " 0xdeadbeef" << ", " << "ends" << endl;
-    sortedDataSegment = vector<pair<long, long>>(dataSegment.begin(), dataSegment.end());
-    sort(sortedDataSegment.begin(), sortedDataSegment.end());
-    for (const auto& [key,value] : sortedDataSegment) {
-        outFile << "0x" << hex << key << " 0x" << setw(2) << setfill('0') << value << endl;
+
+    ~WorkStealingPool() {
+        {
+            lock_guard<mutex> guard(stateLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread& t : threads) {
+            t.join();
+        }
     }
 
-    inFile.close();
-    outFile.close();
-}
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    unsigned size() const {
+        return workers.size();
+    }
 
-int main() {
-    assemble("input.asm", "output.mc");
-    cout << "Assembly translation complete. Check output.mc" << endl;
+    void submit(function<void()> task) {
+        // Tasks submitted from a worker stay on that worker's deque
+        size_t target = currentPool == this ? currentWorker : nextWorker++ % workers.size();
+        pending++;
+        {
+            lock_guard<mutex> guard(workers[target]->lock);
+            workers[target]->tasks.push_back(move(task));
+        }
+        queued++;
+        {
+            lock_guard<mutex> guard(stateLock);
+        }
+        wake.notify_one();
+        if (helpers > 0) {
+            progress.notify_all();
+        }
+    }
+
+    // Blocks until every submitted task has finished
+    void wait() {
+        unique_lock<mutex> guard(stateLock);
+        idle.wait(guard, [this] { return pending == 0; });
+    }
+
+    // Runs one queued task on the calling thread, returns false if there was none.
+    // Lets a task that waits on other tasks help out instead of blocking a worker.
+    bool runPendingTask() {
+        function<void()> task;
+        size_t self = currentPool == this ? currentWorker : 0;
+        if (!popTask(self, task)) {
+            return false;
+        }
+        execute(task);
+        return true;
+    }
+
+    // Runs queued tasks on the calling thread until done() holds, and sleeps while there
+    // are none. Finishing or queuing a task wakes the sleepers to check again, so a task
+    // that waits on tasks it submitted neither spins nor holds up the ones it waits for.
+    void helpUntil(const function<bool()>& done) {
+        while (!done()) {
+            if (runPendingTask()) {
+                continue;
+            }
+            unique_lock<mutex> guard(stateLock);
+            helpers++;
+            progress.wait(guard, [&] { return done() || queued > 0; });
+            helpers--;
+        }
+    }
+
+private:
+    struct Worker {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    bool popTask(size_t self, function<void()>& task) {
+        {
+            lock_guard<mutex> guard(workers[self]->lock);
+            if (!workers[self]->tasks.empty()) {
+                task = move(workers[self]->tasks.back());
+                workers[self]->tasks.pop_back();
+                queued--;
+                return true;
+            }
+        }
+        for (size_t i = 1; i < workers.size(); i++) {
+            Worker& victim = *workers[(self + i) % workers.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = move(victim.tasks.front());
+                victim.tasks.pop_front();
+                queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void execute(function<void()>& task) {
+        task();
+        bool last = --pending == 0;
+        if (last || helpers > 0) {
+            lock_guard<mutex> guard(stateLock);
+            if (last) {
+                idle.notify_all();
+            }
+            progress.notify_all();
+        }
+    }
+
+    void run(size_t self) {
+        currentPool = this;
+        currentWorker = self;
+        function<void()> task;
+        while (true) {
+            if (popTask(self, task)) {
+                execute(task);
+                continue;
+            }
+            unique_lock<mutex> guard(stateLock);
+            wake.wait(guard, [this] { return stopping || queued > 0; });
+            if (stopping && queued == 0) {
+                return;
+            }
+        }
+    }
+
+    vector<unique_ptr<Worker>> workers;
+    vector<thread> threads;
+    mutex stateLock;
+    condition_variable wake;
+    condition_variable idle;
+    condition_variable progress;    // a task finished or was queued, for helpUntil()
+    atomic<size_t> pending{0};
+    atomic<size_t> queued{0};
+    atomic<size_t> nextWorker{0};
+    atomic<unsigned> helpers{0};    // threads asleep in helpUntil()
+    bool stopping = false;
+
+    static thread_local WorkStealingPool* currentPool;
+    static thread_local size_t currentWorker;
+};
+
+thread_local WorkStealingPool* WorkStealingPool::currentPool = nullptr;
+thread_local size_t WorkStealingPool::currentWorker = 0;
+
+// Runs body(i) for every i in [0, count) on the pool and returns once all of them are done.
+// The calling thread works through queued tasks while it waits and sleeps once there are
+// none, so this is safe to use from inside another pool task.
+void parallelFor(WorkStealingPool& pool, size_t count, const function<void(size_t)>& body) {
+    atomic<size_t> remaining{count};
+    for (size_t i = 0; i < count; i++) {
+        pool.submit([&body, &remaining, i] {
+            body(i);
+            remaining--;
+        });
+    }
+    pool.helpUntil([&remaining] { return remaining == 0; });
+}
+
+enum OutputMode { ANNOTATED_OUTPUT, COMPACT_OUTPUT, BINARY_OUTPUT };
+
+// Formats output.mc into one reusable buffer and writes it out in large blocks. Without a
+// path the writer only collects into memory, see contents().
+//   annotated: "0x<addr> 0x<word> , <source> # <fields>", the default output.mc
+//   compact:   "0x<addr> 0x<word>"
+//   binary:    text words as little-endian 32-bit values, the 0xdeadbeef terminator,
+//              then the data segment bytes in address order
+class OutputWriter {
+public:
+    OutputWriter(const string& path, OutputMode mode) : outFile(path, ios::binary), toFile(true), mode(mode) {
+        buffer.reserve(FLUSH_SIZE + 4096);
+    }
+
+    explicit OutputWriter(OutputMode mode) : toFile(false), mode(mode) {}
+
+    ~OutputWriter() {
+        flush();
+    }
+
+    bool wantsDetails() const {
+        return mode == ANNOTATED_OUTPUT;
+    }
+
+    // False if the output file could not be created
+    bool isOpen() const {
+        return !toFile || outFile.is_open();
+    }
+
+    // Writes out everything buffered, returns false if any write to the file failed
+    bool finish() {
+        flush();
+        if (toFile) {
+            outFile.flush();
+        }
+        return !toFile || (bool)outFile;
+    }
+
+    void instruction(uint32_t address, uint32_t word, string_view line, string_view details) {
+        if (mode == BINARY_OUTPUT) {
+            appendWord(word);
+        } else {
+            appendHex(address, 1);
+            buffer += ' ';
+            appendHex(word, 8);
+            if (mode == ANNOTATED_OUTPUT) {
+                buffer += " , ";
+                buffer += line;
+                buffer += " # ";
+                buffer += details;
+            }
+            buffer += '\n';
+        }
+        flushIfFull();
+    }
+
+    void textEnd(uint32_t address) {
+        if (mode == BINARY_OUTPUT) {
+            appendWord(0xdeadbeef);
+            return;
+        }
+        appendHex(address, 1);
+        buffer += mode == ANNOTATED_OUTPUT ? " 0xdeadbeef, ends\n" : " 0xdeadbeef\n";
+    }
+
+    void dataByte(uint64_t address, uint8_t value) {
+        if (mode == BINARY_OUTPUT) {
+            buffer += (char)value;
+        } else {
+            appendHex(address, 1);
+            buffer += ' ';
+            appendHex(value, 2);
+            buffer += '\n';
+        }
+        flushIfFull();
+    }
+
+    // Copies already formatted output, e.g. the contents() of an in-memory writer
+    void append(string_view formatted) {
+        buffer += formatted;
+        flushIfFull();
+    }
+
+    const string& contents() const {
+        return buffer;
+    }
+
+    // Empties an in-memory writer for reuse, keeping its buffer
+    void clear() {
+        buffer.clear();
+    }
+
+    void setStats(AssemblerStats* assemblerStats) {
+        stats = assemblerStats;
+    }
+
+    void flush() {
+        if (toFile) {
+            PhaseTimer timer(stats, PHASE_WRITE);
+            outFile.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+
+private:
+    static constexpr size_t FLUSH_SIZE = 1 << 16;
+
+    void flushIfFull() {
+        if (toFile && buffer.size() >= FLUSH_SIZE) {
+            flush();
+        }
+    }
+
+    // "0x" followed by lowercase hex digits, zero padded to minDigits
+    void appendHex(uint64_t value, int minDigits) {
+        static const char digits[] = "0123456789abcdef";
+        char text[16];
+        int count = 0;
+        do {
+            text[count++] = digits[value & 0xF];
+            value >>= 4;
+        } while (value != 0);
+        while (count < minDigits) {
+            text[count++] = '0';
+        }
+        buffer += "0x";
+        while (count > 0) {
+            buffer += text[--count];
+        }
+    }
+
+    void appendWord(uint32_t word) {
+        for (int i = 0; i < 4; i++) {
+            buffer += (char)(word >> (8 * i) & 0xFF);
+        }
+    }
+
+    ofstream outFile;
+    bool toFile;
+    OutputMode mode;
+    string buffer;
+    AssemblerStats* stats = nullptr;
+};
+
+struct EncodedLine {
+    uint32_t machineCode[MAX_EXPANSION];
+    string details[MAX_EXPANSION];   // the field breakdown of each word for annotated output
+    int words = 0;
+    bool valid = false;     // false if the line had errors, they are in the Diagnostics
+};
+
+// Writes every word of a line, the first at address
+void writeEncoded(OutputWriter& out, int address, string_view line, const EncodedLine& encoded) {
+    for (int i = 0; i < encoded.words; i++) {
+        out.instruction(address + 4 * i, encoded.machineCode[i], line, encoded.details[i]);
+    }
+}
+
+// The word for one machine instruction, and its field breakdown if details is given
+uint32_t encodeMachineInstruction(const MachineInstruction& op, string* details) {
+    const InstructionInfo& info = *op.info;
+    uint32_t machineCode = 0;
+    switch (info.format) {
+        case R_FORMAT: {
+            machineCode = encodeRFormat(info, op.rd, op.rs1, op.rs2);
+            if (details != nullptr) {
+                *details = formatBinaryInstruction(
+                    opcodeBits(info), funct3Bits(info), funct7Bits(info), 
+                    registerBits(op.rd), registerBits(op.rs1), registerBits(op.rs2), ""
+                );
+            }
+            break;
+        }
+        case S_FORMAT: {
+            machineCode = encodeSFormat(info, op.rs1, op.rs2, op.immediate);
+            if (details != nullptr) {
+                *details = formatBinaryInstruction(
+                    opcodeBits(info), funct3Bits(info), "", "", 
+                    registerBits(op.rs1), registerBits(op.rs2), 
+                    bitset<12>(op.immediate).to_string()
+                );
+            }
+            break;
+        }
+        case SB_FORMAT: {
+            bitset<13> offset(op.immediate);
+            offset &= ~bitset<13>(3);  
+            machineCode = encodeSBFormat(info, op.rs1, op.rs2, offset.to_ulong());
+            if (details != nullptr) {
+                *details = formatBinaryInstruction(
+                    opcodeBits(info), funct3Bits(info), "", "", 
+                    registerBits(op.rs1), registerBits(op.rs2), offset.to_string()
+                );
+            }
+            break;
+        }
+        case I_FORMAT: {
+            machineCode = encodeIFormat(info, op.rd, op.rs1, op.immediate);
+            if (details != nullptr) {
+                *details = formatBinaryInstruction(
+                    opcodeBits(info), funct3Bits(info), "", 
+                    registerBits(op.rd), registerBits(op.rs1), "", 
+                    bitset<12>(op.immediate).to_string()
+                );
+            }
+            break;
+        }
+        case U_FORMAT: {
+            machineCode = encodeUFormat(info, op.rd, op.immediate);
+            if (details != nullptr) {
+                *details = formatBinaryInstruction(
+                    opcodeBits(info), "", "", registerBits(op.rd), "", "", bitset<20>(op.immediate).to_string()
+                );
+            }
+            break;
+        }
+        case UJ_FORMAT: {
+            bitset<21> offset(op.immediate);
+            offset &= ~bitset<21>(3);  
+            machineCode = encodeUJFormat(info, op.rd, offset.to_ulong());
+            if (details != nullptr) {
+                *details = formatBinaryInstruction(
+                    opcodeBits(info), "", "", registerBits(op.rd), "", "", offset.to_string()
+                );
+            }
+            break;
+        }
+    }
+    return machineCode;
+}
+
+// Builds the words for a parsed instruction, and their field breakdown if withDetails is
+// set. The label operand is resolved here, an undefined one or one out of reach of an
+// unrelaxed branch (--one-pass cannot relax) is reported to diag, which must point at
+// the line.
+void encodeInstruction(const SymbolTable& symbols, Diagnostics& diag, const IrInstruction& ir,
+                       string_view line, EncodedLine& encoded, bool withDetails) {
+    encoded.valid = false;
+    encoded.words = 0;
+    if (ir.instruction == NO_INSTRUCTION || ir.words == 0) {
+        return;
+    }
+    bool valid = ir.valid;
+    uint32_t offset = ir.immediate;
+    if (ir.symbol >= 0) {
+        const Symbol& label = symbols[ir.symbol];
+        int64_t distance = (int64_t)label.address - ir.address;
+        InstructionFormat format = instructionTable[ir.instruction].format;
+        if (!label.defined) {
+            diag.error(labelOperand(line), "Undefined label " + string(label.name));
+            valid = false;
+            distance = 0;
+        } else if (ir.valid && ir.words == 1 && ir.pseudo == PSEUDO_NONE &&
+                   (format == SB_FORMAT ? !fitsBranch(distance) : !fitsJal(distance))) {
+            diag.error(labelOperand(line), "Label " + string(label.name) + " out of range");
+            valid = false;
+        }
+        offset = (uint32_t)distance;
+    }
+
+    MachineInstruction sequence[MAX_EXPANSION];
+    encoded.words = expandInstruction(ir, offset, sequence);
+    for (int i = 0; i < encoded.words; i++) {
+        encoded.machineCode[i] = encodeMachineInstruction(sequence[i], withDetails ? &encoded.details[i] : nullptr);
+    }
+    encoded.valid = valid;
+}
+
+void writeDataSegment(AssemblerContext& ctx, OutputWriter& outFile) {
+    PhaseTimer timer(ctx.stats, PHASE_DATA);
+    const vector<uint8_t>& bytes = ctx.dataSegment.data();
+    if (ctx.stats != nullptr) {
+        ctx.stats->dataBytes += bytes.size();
+    }
+    for (size_t i = 0; i < bytes.size(); i++) {
+        outFile.dataByte(DATA_BASE + i, bytes[i]);
+    }
+}
+
+struct AssemblerOptions {
+    OutputMode mode = ANNOTATED_OUTPUT;
+    bool onePass = false;
+    bool optimize = false;              // peephole pass, see optimizeProgram()
+    bool incremental = false;           // reuse encodings from <output>.cache
+    bool object = false;                // write a relocatable object, see assembleObject()
+    WorkStealingPool* pool = nullptr;   // encode the text segment in parallel when set
+    AssemblerStats* stats = nullptr;    // collect timings and counts when set
+};
+
+const size_t MIN_CHUNK_LINES = 2048;
+
+// Second pass of assemble() split across the pool. Once firstPass() has fixed every label
+// and address, instructions are independent: each chunk is encoded into its own
+// in-memory writer and the chunks are appended in order.
+void encodeParallel(AssemblerContext& ctx, OutputWriter& outFile, OutputMode mode, WorkStealingPool& pool) {
+    PhaseTimer timer(ctx.stats, PHASE_ENCODE);
+    const Program& program = ctx.program;
+    size_t chunkSize = max(MIN_CHUNK_LINES, program.count / (pool.size() * 4) + 1);
+    size_t chunkCount = (program.count + chunkSize - 1) / chunkSize;
+    deque<OutputWriter> chunks;
+    for (size_t i = 0; i < chunkCount; i++) {
+        chunks.emplace_back(mode);
+    }
+    vector<Diagnostics> errors(chunkCount);
+
+    parallelFor(pool, chunkCount, [&](size_t chunk) {
+        EncodedLine encoded;
+        OutputWriter& out = chunks[chunk];
+        Diagnostics& diag = errors[chunk];
+        diag.file = ctx.diagnostics.file;
+        size_t end = min(program.count, (chunk + 1) * chunkSize);
+        for (size_t i = chunk * chunkSize; i < end; i++) {
+            const IrInstruction& ir = program.instructions[i];
+            string_view line = program.line(ir);
+            diag.setLine(line, ir.lineNumber);
+            encodeInstruction(ctx.symbols, diag, ir, line, encoded, out.wantsDetails());
+            if (encoded.valid) {
+                writeEncoded(out, ir.address, line, encoded);
+            }
+        }
+    });
+
+    for (size_t i = 0; i < chunkCount; i++) {
+        ctx.diagnostics.append(errors[i]);
+        outFile.append(chunks[i].contents());
+    }
+}
+
+// assemble() once the source is in memory, also used by --serve
+void assembleSource(AssemblerContext& ctx, string_view source, OutputWriter& outFile,
+                    const AssemblerOptions& options) {
+    firstPass(ctx, source);
+    const Program& program = ctx.program;
+    if (options.pool != nullptr) {
+        encodeParallel(ctx, outFile, options.mode, *options.pool);
+    } else {
+        PhaseTimer encodeTimer(ctx.stats, PHASE_ENCODE);
+        EncodedLine encoded;
+        bool withDetails = outFile.wantsDetails();
+        for (size_t i = 0; i < program.count; i++) {
+            const IrInstruction& ir = program.instructions[i];
+            string_view line = program.line(ir);
+            ctx.diagnostics.setLine(line, ir.lineNumber);
+            encodeInstruction(ctx.symbols, ctx.diagnostics, ir, line, encoded, withDetails);
+            if (encoded.valid) {
+                writeEncoded(outFile, ir.address, line, encoded);
+            }
+        }
+    }
+    outFile.textEnd(program.endAddress);
+    writeDataSegment(ctx, outFile);
+}
+
+void assemble(AssemblerContext& ctx, const string& inputFile, const string& outputFile,
+              const AssemblerOptions& options) {
+    PhaseTimer readTimer(ctx.stats, PHASE_READ);
+    SourceFile inFile(inputFile);
+    readTimer.stop();
+    if (!inFile.isOpen()) {
+        ctx.diagnostics.fileError("Cannot open " + inputFile);
+        return;
+    }
+    OutputWriter outFile(outputFile, options.mode);
+    if (!outFile.isOpen()) {
+        ctx.diagnostics.fileError("Cannot write " + outputFile);
+        return;
+    }
+    outFile.setStats(ctx.stats);
+    assembleSource(ctx, inFile.text(), outFile, options);
+    if (!outFile.finish()) {
+        ctx.diagnostics.fileError("Cannot write " + outputFile);
+    }
+}
+
+struct PendingLine {
+    string_view line;
+    IrInstruction ir;
+    EncodedLine encoded;
+};
+
+// Single pass variant of assemble(): the source is read once and forward references to
+// labels are kept in a fixup table and re-encoded when the label gets defined. Output is
+// buffered only while some fixup is still pending.
+void assembleOnePass(AssemblerContext& ctx, const string& inputFile, const string& outputFile,
+                     const AssemblerOptions& options) {
+    PhaseTimer readTimer(ctx.stats, PHASE_READ);
+    SourceFile inFile(inputFile);
+    readTimer.stop();
+    if (!inFile.isOpen()) {
+        ctx.diagnostics.fileError("Cannot open " + inputFile);
+        return;
+    }
+    OutputWriter outFile(outputFile, options.mode);
+    if (!outFile.isOpen()) {
+        ctx.diagnostics.fileError("Cannot write " + outputFile);
+        return;
+    }
+    outFile.setStats(ctx.stats);
+    LineScanner lines(inFile.text());
+    Diagnostics& diag = ctx.diagnostics;
+    bool withDetails = outFile.wantsDetails();
+    unordered_map<int, vector<size_t>> fixups;   // label symbol -> lines waiting for it
+    vector<PendingLine> pendingOutput;   // lines not yet written, starting at index flushedLines
+    size_t flushedLines = 0;
+    size_t pendingFixups = 0;
+    string_view line;
+    int lineNumber = 0;
+    int address = 0;
+    long dataAddress = DATA_BASE;
+    bool inTextSegment = true;
+    PhaseTimer encodeTimer(ctx.stats, PHASE_ENCODE);
+
+    while (lines.next(line)) {
+        lineNumber++;
+        diag.setLine(line, lineNumber);
+        string_view rest = line;
+        string_view firstWord = nextToken(rest);
+        if (firstWord.empty()) {
+            continue;
+        }
+
+        if (firstWord == ".text") {
+            inTextSegment = true;
+            continue;
+        } else if (firstWord == ".data") {
+            inTextSegment = false;
+            continue;
+        } else if (firstWord == ".globl" || firstWord == ".global") {
+            continue;   // only matters for --object
+        } else if (firstWord == ".scratch") {
+            parseScratchDirective(ctx, rest, address > 0);
+            continue;
+        }
+        if (inTextSegment == false) {
+            parseDataLine(ctx, line, dataAddress);
+            continue;
+        }
+
+        if (firstWord.back() == ':') {
+            int label = defineLabel(ctx, firstWord.substr(0, firstWord.size() - 1), address);
+            auto it = fixups.find(label);
+            if (it != fixups.end()) {
+                for (size_t lineIndex : it->second) {
+                    PendingLine& fixup = pendingOutput[lineIndex - flushedLines];
+                    diag.setLine(fixup.line, fixup.ir.lineNumber);
+                    encodeInstruction(ctx.symbols, diag, fixup.ir, fixup.line, fixup.encoded, withDetails);
+                    pendingFixups--;
+                }
+                fixups.erase(it);
+                diag.setLine(line, lineNumber);
+            }
+        }
+
+        PendingLine pending = {line, IrInstruction(), EncodedLine()};
+        IrInstruction& ir = pending.ir;
+        if (!parseInstruction(ctx.symbols, diag, line, ir)) {
+            continue;
+        }
+        checkScratchUse(ctx, ir, line);
+        ir.lineNumber = lineNumber;
+        ir.address = address;
+        address += 4 * ir.words;
+        if (ctx.stats != nullptr && ir.instruction != NO_INSTRUCTION) {
+            ctx.stats->instructions[instructionTable[ir.instruction].format]++;
+        }
+        if (ir.symbol >= 0 && !ctx.symbols[ir.symbol].defined) {
+            fixups[ir.symbol].push_back(flushedLines + pendingOutput.size());
+            pendingOutput.push_back(move(pending));
+            pendingFixups++;
+            continue;
+        }
+        encodeInstruction(ctx.symbols, diag, ir, line, pending.encoded, withDetails);
+        pendingOutput.push_back(move(pending));
+        if (pendingFixups == 0) {
+            for (const PendingLine& out : pendingOutput) {
+                if (out.encoded.valid) {
+                    writeEncoded(outFile, out.ir.address, out.line, out.encoded);
+                }
+            }
+            flushedLines += pendingOutput.size();
+            pendingOutput.clear();
+        }
+    }
+
+    // Whatever is still in the table uses a data label defined after it, or one never
+    // defined, which encodeInstruction() reports
+    for (const auto& [label, list] : fixups) {
+        for (size_t lineIndex : list) {
+            PendingLine& fixup = pendingOutput[lineIndex - flushedLines];
+            diag.setLine(fixup.line, fixup.ir.lineNumber);
+            encodeInstruction(ctx.symbols, diag, fixup.ir, fixup.line, fixup.encoded, withDetails);
+        }
+    }
+    for (const PendingLine& out : pendingOutput) {
+        if (out.encoded.valid) {
+            writeEncoded(outFile, out.ir.address, out.line, out.encoded);
+        }
+    }
+    encodeTimer.stop();
+    if (ctx.stats != nullptr) {
+        ctx.stats->lines += lineNumber;
+        ctx.stats->labels += ctx.symbols.defined();
+    }
+    outFile.textEnd(address);
+    writeDataSegment(ctx, outFile);
+    if (!outFile.finish()) {
+        diag.fileError("Cannot write " + outputFile);
+    }
+}
+
+const char CACHE_MAGIC[8] = {'P', '1', 'C', 'A', 'C', 'H', 'E', '2'};
+
+// Cache key of a text line: a hash of its text and, for a branch or jal to a label, the
+// offset that label resolves to and the .scratch register a far one jumps through. Any
+// other line encodes the same at every address.
+// --optimize can rewrite or remove a line without touching its text, so its immediate
+// and word count go in as well. Returns false for lines using an undefined label, which
+// are never cached.
+bool encodingKey(AssemblerContext& ctx, const IrInstruction& ir, string_view line, uint64_t& key) {
+    key = hashBytes(line.data(), line.size());
+    if (ctx.optimize) {
+        key = hashBytes(&ir.immediate, sizeof(ir.immediate), key);
+        key = hashBytes(&ir.words, sizeof(ir.words), key);
+    }
+    if (ir.symbol < 0) {
+        return true;
+    }
+    const Symbol& label = ctx.symbols[ir.symbol];
+    if (!label.defined) {
+        return false;
+    }
+    if (ir.scratch != 0) {
+        key = hashBytes(&ir.scratch, sizeof(ir.scratch), key);
+    }
+    int32_t offset = label.address - ir.address;
+    key = hashBytes(&offset, sizeof(offset), key);
+    return true;
+}
+
+// A missing or unreadable cache is just empty
+unordered_map<uint64_t, EncodedLine> loadEncodingCache(const string& path) {
+    unordered_map<uint64_t, EncodedLine> cache;
+    ifstream in(path, ios::binary);
+    char magic[sizeof(CACHE_MAGIC)];
+    uint64_t count = 0;
+    if (!in.read(magic, sizeof(magic)) || memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0 ||
+        !in.read(reinterpret_cast<char*>(&count), sizeof(count))) {
+        return cache;
+    }
+    cache.reserve(count);
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t key;
+        uint32_t words;
+        EncodedLine entry;
+        in.read(reinterpret_cast<char*>(&key), sizeof(key));
+        in.read(reinterpret_cast<char*>(&words), sizeof(words));
+        if (!in || words == 0 || words > MAX_EXPANSION) {
+            cache.clear();
+            break;
+        }
+        entry.words = words;
+        entry.valid = true;
+        for (uint32_t word = 0; word < words; word++) {
+            uint32_t detailsLength = 0;
+            in.read(reinterpret_cast<char*>(&entry.machineCode[word]), sizeof(uint32_t));
+            in.read(reinterpret_cast<char*>(&detailsLength), sizeof(detailsLength));
+            entry.details[word].resize(detailsLength);
+            in.read(entry.details[word].data(), detailsLength);
+        }
+        if (!in) {
+            cache.clear();
+            break;
+        }
+        cache[key] = move(entry);
+    }
+    return cache;
+}
+
+// Written next to the final name and renamed over it, so an interrupted run leaves the
+// old cache intact
+void saveEncodingCache(const string& path, const unordered_map<uint64_t, EncodedLine>& cache) {
+    string temporary = path + ".tmp";
+    {
+        ofstream out(temporary, ios::binary);
+        uint64_t count = cache.size();
+        out.write(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        for (const auto& [key, entry] : cache) {
+            uint32_t words = entry.words;
+            out.write(reinterpret_cast<const char*>(&key), sizeof(key));
+            out.write(reinterpret_cast<const char*>(&words), sizeof(words));
+            for (int word = 0; word < entry.words; word++) {
+                uint32_t detailsLength = entry.details[word].size();
+                out.write(reinterpret_cast<const char*>(&entry.machineCode[word]), sizeof(uint32_t));
+                out.write(reinterpret_cast<const char*>(&detailsLength), sizeof(detailsLength));
+                out.write(entry.details[word].data(), detailsLength);
+            }
+        }
+        if (!out) {
+            return;
+        }
+    }
+    rename(temporary.c_str(), path.c_str());
+}
+
+// Variant of assemble() for --incremental. After firstPass() every text line is looked up
+// in <output>.cache and only the lines whose key is not there get encoded. The cache is
+// then rewritten with exactly the lines of this source.
+void assembleIncremental(AssemblerContext& ctx, const string& inputFile, const string& outputFile,
+                         const AssemblerOptions& options) {
+    PhaseTimer readTimer(ctx.stats, PHASE_READ);
+    SourceFile inFile(inputFile);
+    readTimer.stop();
+    if (!inFile.isOpen()) {
+        ctx.diagnostics.fileError("Cannot open " + inputFile);
+        return;
+    }
+    OutputWriter outFile(outputFile, options.mode);
+    if (!outFile.isOpen()) {
+        ctx.diagnostics.fileError("Cannot write " + outputFile);
+        return;
+    }
+    outFile.setStats(ctx.stats);
+    int endAddress = firstPass(ctx, inFile.text());
+    const Program& program = ctx.program;
+    string cachePath = outputFile + ".cache";
+    unordered_map<uint64_t, EncodedLine> cache = loadEncodingCache(cachePath);
+    unordered_map<uint64_t, EncodedLine> updated;
+    updated.reserve(program.count);
+
+    PhaseTimer encodeTimer(ctx.stats, PHASE_ENCODE);
+    EncodedLine encoded;
+    for (size_t i = 0; i < program.count; i++) {
+        const IrInstruction& ir = program.instructions[i];
+        string_view line = program.line(ir);
+        uint64_t key;
+        bool cacheable = encodingKey(ctx, ir, line, key);
+        if (cacheable) {
+            auto hit = updated.find(key);
+            if (hit == updated.end()) {
+                auto old = cache.find(key);
+                if (old != cache.end()) {
+                    hit = updated.insert(cache.extract(old)).position;
+                }
+            }
+            if (hit != updated.end()) {
+                writeEncoded(outFile, ir.address, line, hit->second);
+                if (ctx.stats != nullptr) {
+                    ctx.stats->cacheHits++;
+                }
+                continue;
+            }
+        }
+        // Details are always built so the cache serves every output mode
+        ctx.diagnostics.setLine(line, ir.lineNumber);
+        encodeInstruction(ctx.symbols, ctx.diagnostics, ir, line, encoded, true);
+        if (ctx.stats != nullptr) {
+            ctx.stats->cacheMisses++;
+        }
+        if (encoded.valid) {
+            writeEncoded(outFile, ir.address, line, encoded);
+            if (cacheable) {
+                updated[key] = encoded;
+            }
+        }
+    }
+    encodeTimer.stop();
+    outFile.textEnd(endAddress);
+    writeDataSegment(ctx, outFile);
+    if (!outFile.finish()) {
+        ctx.diagnostics.fileError("Cannot write " + outputFile);
+        return;
+    }
+    saveEncodingCache(cachePath, updated);
+}
+
+// Relocatable object written by --object and merged by linkObjects(). The text section is
+// encoded for address 0 and the data section for DATA_BASE. Relocations patch the words
+// that refer to another module, or to data, whose address only the link fixes.
+const char OBJECT_MAGIC[8] = {'P', '1', 'O', 'B', 'J', 'E', 'C', '2'};
+
+enum ObjectSection : uint8_t { SECTION_UNDEFINED, SECTION_TEXT, SECTION_DATA };
+
+enum RelocationKind : uint8_t {
+    RELOC_BRANCH,   // 13-bit offset of beq/bne/bge/blt
+    RELOC_JAL,      // 21-bit offset of jal, j and call
+    RELOC_PCREL     // 32-bit offset of the auipc+addi pair of la
+};
+
+struct ObjectSymbol {
+    string name;
+    ObjectSection section;
+    bool global;
+    uint32_t offset;    // from the start of its section
+};
+
+struct Relocation {
+    uint32_t offset;    // of the patched word in the text section
+    RelocationKind kind;
+    uint32_t symbol;    // index into ObjectFile::symbols
+};
+
+struct ObjectFile {
+    uint64_t fingerprint;   // objectFingerprint() of the options it was assembled with
+    vector<uint32_t> text;
+    vector<uint8_t> data;
+    vector<ObjectSymbol> symbols;
+    vector<Relocation> relocations;
+};
+
+template <typename T>
+void writeValue(ofstream& out, T value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+bool readValue(ifstream& in, T& value) {
+    return (bool)in.read(reinterpret_cast<char*>(&value), sizeof(value));
+}
+
+// Hash of the options that change what --object writes. --link reassembles an object
+// whose fingerprint differs even if it is newer than its source.
+uint64_t objectFingerprint(bool optimize) {
+    uint8_t options[] = {optimize};
+    return hashBytes(options, sizeof(options));
+}
+
+bool saveObject(const ObjectFile& object, const string& path) {
+    ofstream out(path, ios::binary);
+    out.write(OBJECT_MAGIC, sizeof(OBJECT_MAGIC));
+    writeValue<uint64_t>(out, object.fingerprint);
+    writeValue<uint32_t>(out, object.text.size());
+    writeValue<uint32_t>(out, object.data.size());
+    writeValue<uint32_t>(out, object.symbols.size());
+    writeValue<uint32_t>(out, object.relocations.size());
+    out.write(reinterpret_cast<const char*>(object.text.data()), object.text.size() * sizeof(uint32_t));
+    out.write(reinterpret_cast<const char*>(object.data.data()), object.data.size());
+    for (const ObjectSymbol& symbol : object.symbols) {
+        writeValue<uint8_t>(out, symbol.section);
+        writeValue<uint8_t>(out, symbol.global);
+        writeValue<uint32_t>(out, symbol.offset);
+        writeValue<uint32_t>(out, symbol.name.size());
+        out.write(symbol.name.data(), symbol.name.size());
+    }
+    for (const Relocation& relocation : object.relocations) {
+        writeValue<uint32_t>(out, relocation.offset);
+        writeValue<uint8_t>(out, relocation.kind);
+        writeValue<uint32_t>(out, relocation.symbol);
+    }
+    return (bool)out;
+}
+
+// Reads the magic and the fingerprint that start every object
+bool readObjectHeader(ifstream& in, uint64_t& fingerprint) {
+    char magic[sizeof(OBJECT_MAGIC)];
+    return in.read(magic, sizeof(magic)) && memcmp(magic, OBJECT_MAGIC, sizeof(magic)) == 0 &&
+           readValue(in, fingerprint);
+}
+
+bool loadObject(const string& path, ObjectFile& object) {
+    ifstream in(path, ios::binary);
+    uint32_t textWords, dataBytes, symbolCount, relocationCount;
+    if (!readObjectHeader(in, object.fingerprint) || !readValue(in, textWords) || !readValue(in, dataBytes) || !readValue(in, symbolCount) ||
+        !readValue(in, relocationCount)) {
+        return false;
+    }
+    object.text.resize(textWords);
+    object.data.resize(dataBytes);
+    in.read(reinterpret_cast<char*>(object.text.data()), textWords * sizeof(uint32_t));
+    in.read(reinterpret_cast<char*>(object.data.data()), dataBytes);
+    object.symbols.resize(symbolCount);
+    for (ObjectSymbol& symbol : object.symbols) {
+        uint8_t section, global;
+        uint32_t length;
+        if (!readValue(in, section) || !readValue(in, global) || !readValue(in, symbol.offset) ||
+            !readValue(in, length) || section > SECTION_DATA) {
+            return false;
+        }
+        symbol.section = (ObjectSection)section;
+        symbol.global = global != 0;
+        symbol.name.resize(length);
+        in.read(symbol.name.data(), length);
+    }
+    object.relocations.resize(relocationCount);
+    for (Relocation& relocation : object.relocations) {
+        uint8_t kind;
+        if (!readValue(in, relocation.offset) || !readValue(in, kind) || !readValue(in, relocation.symbol) ||
+            kind > RELOC_PCREL || relocation.symbol >= symbolCount ||
+            relocation.offset / 4 + (kind == RELOC_PCREL) >= textWords) {
+            return false;
+        }
+        relocation.kind = (RelocationKind)kind;
+    }
+    return (bool)in;
+}
+
+// --object: assembles like assemble(), but a branch, jal or la to a label this file does
+// not define, and an la of a data label, is encoded with offset 0 and gets a relocation.
+// Labels named by .globl are exported, the others stay local to the object.
+void assembleObject(AssemblerContext& ctx, const string& inputFile, const string& outputFile) {
+    PhaseTimer readTimer(ctx.stats, PHASE_READ);
+    SourceFile inFile(inputFile);
+    readTimer.stop();
+    if (!inFile.isOpen()) {
+        ctx.diagnostics.fileError("Cannot open " + inputFile);
+        return;
+    }
+    firstPass(ctx, inFile.text());
+    PhaseTimer encodeTimer(ctx.stats, PHASE_ENCODE);
+    const Program& program = ctx.program;
+    ObjectFile object;
+    object.fingerprint = objectFingerprint(ctx.optimize);
+    object.text.resize(program.endAddress / 4);
+    vector<int> objectSymbol(ctx.symbols.size(), -1);
+    for (size_t id = 0; id < ctx.symbols.size(); id++) {
+        const Symbol& symbol = ctx.symbols[id];
+        ObjectSection section = !symbol.defined ? SECTION_UNDEFINED
+                                : symbol.instruction >= 0 ? SECTION_TEXT : SECTION_DATA;
+        uint32_t offset = section == SECTION_DATA ? symbol.address - DATA_BASE : symbol.address;
+        objectSymbol[id] = object.symbols.size();
+        object.symbols.push_back({string(symbol.name), section, symbol.global, section == SECTION_UNDEFINED ? 0 : offset});
+    }
+
+    EncodedLine encoded;
+    for (size_t i = 0; i < program.count; i++) {
+        const IrInstruction& ir = program.instructions[i];
+        string_view line = program.line(ir);
+        ctx.diagnostics.setLine(line, ir.lineNumber);
+        IrInstruction local = ir;
+        if (ir.symbol >= 0 && ir.words > 0 && ir.instruction != NO_INSTRUCTION) {
+            const Symbol& symbol = ctx.symbols[ir.symbol];
+            if (!symbol.defined || (symbol.instruction < 0 && ir.pseudo == PSEUDO_LA)) {
+                InstructionFormat format = instructionTable[ir.instruction].format;
+                RelocationKind kind = ir.pseudo == PSEUDO_LA ? RELOC_PCREL
+                                      : format == SB_FORMAT  ? RELOC_BRANCH : RELOC_JAL;
+                object.relocations.push_back({(uint32_t)ir.address, kind, (uint32_t)objectSymbol[ir.symbol]});
+                local.symbol = -1;
+                local.immediate = 0;
+            }
+        }
+        encodeInstruction(ctx.symbols, ctx.diagnostics, local, line, encoded, false);
+        for (int w = 0; w < encoded.words; w++) {
+            object.text[ir.address / 4 + w] = encoded.machineCode[w];
+        }
+    }
+    object.data = ctx.dataSegment.data();
+    encodeTimer.stop();
+    if (ctx.stats != nullptr) {
+        ctx.stats->dataBytes += object.data.size();
+    }
+    if (ctx.diagnostics.count() == 0 && !saveObject(object, outputFile)) {
+        ctx.diagnostics.fileError("Cannot write " + outputFile);
+    }
+}
+
+// Patches the word(s) of one relocation in text, at pc, to reach target. Returns false if
+// the target is out of reach of the instruction.
+bool applyRelocation(vector<uint32_t>& text, size_t word, RelocationKind kind, int64_t pc, int64_t target) {
+    int64_t offset = target - pc;
+    uint32_t upper, lower;
+    switch (kind) {
+        case RELOC_BRANCH:
+            if (!fitsBranch(offset)) {
+                return false;
+            }
+            text[word] = (text[word] & ~branchOffsetBits(~0u)) | branchOffsetBits(offset);
+            return true;
+        case RELOC_JAL:
+            if (!fitsJal(offset)) {
+                return false;
+            }
+            text[word] = (text[word] & ~jalOffsetBits(~0u)) | jalOffsetBits(offset);
+            return true;
+        case RELOC_PCREL:
+            splitOffset(offset, upper, lower);
+            text[word] = (text[word] & 0xFFF) | upper << 12;
+            text[word + 1] = (text[word + 1] & 0xFFFFF) | lower << 20;
+            return true;
+    }
+    return false;
+}
+
+// --link: lays the objects out in order, text from address 0 and data from DATA_BASE,
+// each data section 8-byte aligned, resolves every relocation against the object's own
+// symbols and then the global ones of all objects, and writes the program like
+// assemble() would. Errors name the object they come from.
+bool linkObjects(const vector<string>& paths, const string& outputFile, OutputMode mode, Diagnostics& diag) {
+    vector<ObjectFile> objects(paths.size());
+    vector<uint32_t> textBase(paths.size()), dataBase(paths.size());
+    uint32_t textSize = 0, dataSize = 0;
+    size_t errorsBefore = diag.count();
+    for (size_t m = 0; m < paths.size(); m++) {
+        diag.file = paths[m];
+        if (!loadObject(paths[m], objects[m])) {
+            diag.fileError("Not a readable object file");
+            continue;
+        }
+        textBase[m] = textSize;
+        textSize += objects[m].text.size() * 4;
+        dataSize = (dataSize + 7) & ~7u;
+        dataBase[m] = DATA_BASE + dataSize;
+        dataSize += objects[m].data.size();
+    }
+    if (diag.count() != errorsBefore) {
+        return false;
+    }
+
+    auto addressOf = [&](size_t m, const ObjectSymbol& symbol) {
+        return (int64_t)(symbol.section == SECTION_TEXT ? textBase[m] : dataBase[m]) + symbol.offset;
+    };
+    unordered_map<string, pair<int64_t, size_t>> globals;   // name -> address, defining object
+    for (size_t m = 0; m < objects.size(); m++) {
+        diag.file = paths[m];
+        for (const ObjectSymbol& symbol : objects[m].symbols) {
+            if (!symbol.global || symbol.section == SECTION_UNDEFINED) {
+                continue;
+            }
+            auto [it, added] = globals.try_emplace(symbol.name, addressOf(m, symbol), m);
+            if (!added) {
+                diag.fileError("Duplicate symbol " + symbol.name + ", also defined in " + paths[it->second.second]);
+            }
+        }
+    }
+
+    vector<uint32_t> text;
+    text.reserve(textSize / 4);
+    vector<uint8_t> data(dataSize);
+    for (size_t m = 0; m < objects.size(); m++) {
+        diag.file = paths[m];
+        ObjectFile& object = objects[m];
+        for (const Relocation& relocation : object.relocations) {
+            const ObjectSymbol& symbol = object.symbols[relocation.symbol];
+            int64_t target;
+            if (symbol.section != SECTION_UNDEFINED) {
+                target = addressOf(m, symbol);
+            } else if (auto it = globals.find(symbol.name); it != globals.end()) {
+                target = it->second.first;
+            } else {
+                diag.fileError("Undefined symbol " + symbol.name);
+                continue;
+            }
+            if (!applyRelocation(object.text, relocation.offset / 4, relocation.kind,
+                                 textBase[m] + relocation.offset, target)) {
+                diag.fileError("Symbol " + symbol.name + " out of range");
+            }
+        }
+        text.insert(text.end(), object.text.begin(), object.text.end());
+        copy(object.data.begin(), object.data.end(), data.begin() + (dataBase[m] - DATA_BASE));
+    }
+    if (diag.count() != errorsBefore) {
+        return false;
+    }
+
+    // Objects keep no source text, so the annotated listing falls back to compact
+    diag.file = outputFile;
+    OutputWriter outFile(outputFile, mode == ANNOTATED_OUTPUT ? COMPACT_OUTPUT : mode);
+    if (!outFile.isOpen()) {
+        diag.fileError("Cannot write " + outputFile);
+        return false;
+    }
+    for (size_t i = 0; i < text.size(); i++) {
+        outFile.instruction(4 * i, text[i], string_view(), string_view());
+    }
+    outFile.textEnd(textSize);
+    for (size_t i = 0; i < data.size(); i++) {
+        outFile.dataByte(DATA_BASE + i, data[i]);
+    }
+    if (!outFile.finish()) {
+        diag.fileError("Cannot write " + outputFile);
+        return false;
+    }
+    return true;
+}
+
+// Runs one assembly in ctx. Errors do not stop the run: lines with errors are left out of
+// the output and every error is recorded in ctx.diagnostics, in source order. Returns true
+// if there were none.
+bool assembleFile(AssemblerContext& ctx, const string& inputFile, const string& outputFile,
+                  const AssemblerOptions& options) {
+    ctx.diagnostics.file = inputFile;
+    ctx.stats = options.stats;
+    ctx.optimize = options.optimize;
+    AssemblerStats* outerStats = threadStats;
+    threadStats = options.stats;
+    if (options.object) {
+        assembleObject(ctx, inputFile, outputFile);
+    } else if (options.incremental) {
+        assembleIncremental(ctx, inputFile, outputFile, options);
+    } else if (options.onePass) {
+        assembleOnePass(ctx, inputFile, outputFile, options);
+    } else {
+        assemble(ctx, inputFile, outputFile, options);
+    }
+    threadStats = outerStats;
+    ctx.diagnostics.sort();
+    if (ctx.stats != nullptr) {
+        ctx.stats->files++;
+        ctx.stats->errors += ctx.diagnostics.count();
+    }
+    return ctx.diagnostics.count() == 0;
+}
+
+struct BatchJob {
+    string inputFile;
+    string outputFile;
+};
+
+// Reads "input.asm output.mc" pairs, one per line. Without an output name the input's
+// extension is replaced by .mc. Returns false if the list cannot be opened.
+bool readBatchList(const string& listFile, vector<BatchJob>& jobs) {
+    SourceFile list(listFile);
+    if (!list.isOpen()) {
+        return false;
+    }
+    string_view text = list.text();
+    string_view line;
+    while (nextLine(text, line)) {
+        line = stripComment(line);
+        string_view input = nextToken(line);
+        string_view output = nextToken(line);
+        if (input.empty()) {
+            continue;
+        }
+        string outputFile(output);
+        if (outputFile.empty()) {
+            outputFile = string(input.substr(0, input.rfind('.'))) + ".mc";
+        }
+        jobs.push_back({string(input), outputFile});
+    }
+    return true;
+}
+
+void printStats(const AssemblerStats& stats, ostream& out) {
+    double total = 0;
+    for (int phase = 0; phase < PHASE_TOKENIZE; phase++) {
+        total += stats.nanoseconds[phase] / 1e6;
+    }
+    out << fixed << setprecision(3);
+    out << "Phase times (ms):\n";
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        out << "  " << left << setw(12) << phaseNames[phase] << right << setw(12)
+            << stats.nanoseconds[phase] / 1e6 << (phase >= PHASE_TOKENIZE ? "  (within the above)" : "") << "\n";
+    }
+    out << "  " << left << setw(12) << "total" << right << setw(12) << total << "\n";
+    out << "Instructions:";
+    for (int format = 0; format < 6; format++) {
+        out << " " << formatNames[format] << "=" << stats.instructions[format];
+    }
+    out << "\n";
+    out << "Files: " << stats.files << ", lines: " << stats.lines << ", labels: " << stats.labels
+        << ", data bytes: " << stats.dataBytes << ", errors: " << stats.errors << "\n";
+    out << "Cache: " << stats.cacheHits << " hits, " << stats.cacheMisses << " misses\n";
+    out << "Optimizer: " << stats.removed << " instructions removed\n";
+    out << "Heap: " << stats.allocations << " allocations, " << stats.allocationBytes << " bytes\n";
+}
+
+void writeStatsJson(const AssemblerStats& stats, ostream& out) {
+    out << "{\n  \"phases_ns\": {";
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        out << (phase ? ", " : "") << "\"" << phaseNames[phase] << "\": " << stats.nanoseconds[phase];
+    }
+    out << "},\n  \"instructions\": {";
+    for (int format = 0; format < 6; format++) {
+        out << (format ? ", " : "") << "\"" << formatNames[format] << "\": " << stats.instructions[format];
+    }
+    out << "},\n";
+    out << "  \"files\": " << stats.files << ",\n";
+    out << "  \"lines\": " << stats.lines << ",\n";
+    out << "  \"labels\": " << stats.labels << ",\n";
+    out << "  \"data_bytes\": " << stats.dataBytes << ",\n";
+    out << "  \"errors\": " << stats.errors << ",\n";
+    out << "  \"cache_hits\": " << stats.cacheHits << ",\n";
+    out << "  \"cache_misses\": " << stats.cacheMisses << ",\n";
+    out << "  \"removed\": " << stats.removed << ",\n";
+    out << "  \"allocations\": " << stats.allocations << ",\n";
+    out << "  \"allocated_bytes\": " << stats.allocationBytes << "\n}\n";
+}
+
+// Assembles every job on the pool, each in its own context. Diagnostics are printed per
+// file once all jobs are done. Returns the number of files that failed.
+size_t assembleBatch(const vector<BatchJob>& jobs, AssemblerOptions options, bool parallelFiles,
+                     unsigned threadCount) {
+    vector<AssemblerContext> contexts(jobs.size());
+    vector<char> succeeded(jobs.size(), 0);
+    {
+        WorkStealingPool pool(threadCount);
+        if (parallelFiles) {
+            options.pool = &pool;
+        }
+        for (size_t i = 0; i < jobs.size(); i++) {
+            pool.submit([&, i] {
+                succeeded[i] = assembleFile(contexts[i], jobs[i].inputFile, jobs[i].outputFile, options);
+            });
+        }
+        pool.wait();
+    }
+
+    size_t failures = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        for (const Diagnostic& diagnostic : contexts[i].diagnostics.entries) {
+            cerr << formatDiagnostic(diagnostic) << endl;
+        }
+        if (!succeeded[i]) {
+            failures++;
+        }
+    }
+    cout << "Assembled " << jobs.size() - failures << " of " << jobs.size() << " files" << endl;
+    return failures;
+}
+
+// Parses all of text as a number of T's type, for command-line values and
+// --serve requests
+template <typename T>
+bool parseNumber(string_view text, T& value) {
+    const char* end = text.data() + text.size();
+    auto result = from_chars(text.data(), end, value);
+    return !text.empty() && result.ec == errc() && result.ptr == end;
+}
+
+// Limits on a --serve request, so one client cannot make the server buffer without end
+const size_t MAX_SERVE_SOURCE = 64 << 20;   // bytes of a SOURCE request or a FILE
+const size_t MAX_SERVE_LINE = 4096;         // bytes of a request line
+
+// One --serve client. The poll loop in serve() owns it: it reads requests into input and
+// writes replies from output, and while busy a pool worker is assembling into output.
+struct ServeConnection {
+    int fd;
+    string input;               // received, not yet taken as a request
+    string output;              // reply, sent from offset sent on
+    size_t sent = 0;
+    atomic<bool> busy{false};
+    bool peerDone = false;      // the peer sent everything it will
+    bool closeAfterReply = false;   // the request stream is broken, stop after this reply
+};
+
+// What a pool worker assembles --serve requests in. Each worker thread keeps one, reset
+// between requests, so the arena, tables and listing buffer are allocated once.
+struct ServeWorkspace {
+    AssemblerContext ctx;
+    OutputWriter listing{COMPACT_OUTPUT};
+};
+
+// Assembles one --serve request in the calling worker's workspace and appends the reply
+// to reply: "<listing lines> <errors>", then the --compact listing, then the errors as
+// they would be printed on stderr
+void serveRequest(const string& name, string_view source, const AssemblerOptions& options, string& reply) {
+    static thread_local ServeWorkspace workspace;
+    AssemblerContext& ctx = workspace.ctx;
+    OutputWriter& listing = workspace.listing;
+    ctx.reset();
+    listing.clear();
+    ctx.diagnostics.file = name;
+    ctx.optimize = options.optimize;
+    assembleSource(ctx, source, listing, options);
+    ctx.diagnostics.sort();
+    const string& text = listing.contents();
+    reply += to_string(count(text.begin(), text.end(), '\n'));
+    reply += ' ';
+    reply += to_string(ctx.diagnostics.count());
+    reply += '\n';
+    reply += text;
+    for (const Diagnostic& diagnostic : ctx.diagnostics.entries) {
+        reply += formatDiagnostic(diagnostic);
+        reply += '\n';
+    }
+}
+
+string serveError(const string& name, const string& message) {
+    return "0 1\n" + name + ": error: " + message + "\n";
+}
+
+// A FILE request: path must name a regular file inside root, the directory the server
+// was started in, after following symbolic links
+void serveFile(const string& path, const string& root, const AssemblerOptions& options, string& reply) {
+    char* resolved = realpath(path.c_str(), nullptr);
+    string real = resolved != nullptr ? resolved : "";
+    free(resolved);
+    struct stat info;
+    if (real.empty() || stat(real.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+        reply = serveError(path, "Cannot open " + path);
+    } else if (real.compare(0, root.size() + 1, root + "/") != 0) {
+        reply = serveError(path, "Not inside " + root);
+    } else if ((size_t)info.st_size > MAX_SERVE_SOURCE) {
+        reply = serveError(path, "Larger than " + to_string(MAX_SERVE_SOURCE) + " bytes");
+    } else {
+        SourceFile file(real);
+        serveRequest(path, file.text(), options, reply);
+    }
+}
+
+// Takes the first complete request off connection.input and returns the work that
+// answers it into connection.output, or an empty function if the request is not all
+// there yet. A request is "SOURCE <bytes>" followed by that much source text, or
+// "FILE <path>". A malformed or oversized request is answered with an error and ends
+// the connection, since the stream can no longer be split into requests.
+function<void(string&)> takeRequest(ServeConnection& connection, const string& root,
+                                    const AssemblerOptions& options) {
+    string& input = connection.input;
+    size_t end = input.find('\n');
+    if (end == string::npos) {
+        if (input.size() <= MAX_SERVE_LINE) {
+            return nullptr;
+        }
+        end = MAX_SERVE_LINE;
+    }
+    string_view rest(input.data(), min(end, MAX_SERVE_LINE));
+    string_view verb = nextToken(rest);
+    string reply;
+    if (end >= MAX_SERVE_LINE) {
+        reply = serveError("<request>", "Request line longer than " + to_string(MAX_SERVE_LINE) + " bytes");
+    } else if (verb == "SOURCE") {
+        string_view length = nextToken(rest);
+        size_t bytes = 0;
+        if (!parseNumber(length, bytes) || bytes > MAX_SERVE_SOURCE) {
+            reply = serveError("<request>", "SOURCE takes a length of at most " + to_string(MAX_SERVE_SOURCE) +
+                                                " bytes, not " + string(length));
+        } else if (input.size() - end - 1 < bytes) {
+            return nullptr;
+        } else {
+            string source = input.substr(end + 1, bytes);
+            input.erase(0, end + 1 + bytes);
+            return [source, &options](string& out) { serveRequest("<source>", source, options, out); };
+        }
+    } else if (verb == "FILE") {
+        string path(nextToken(rest));
+        input.erase(0, end + 1);
+        return [path, &root, &options](string& out) { serveFile(path, root, options, out); };
+    } else {
+        string request(verb);
+        input.erase(0, end + 1);
+        return [request](string& out) { out = serveError("<request>", "Unknown request " + request); };
+    }
+    connection.closeAfterReply = true;
+    input.clear();
+    return [reply](string& out) { out = reply; };
+}
+
+// --serve: keeps the assembler running on a Unix domain socket so callers skip process
+// startup. One thread polls every connection and reads requests; only complete ones go
+// to the pool, so up to threadCount requests are assembled at once however many clients
+// sit idle. Only returns on errors.
+bool serve(const string& path, const AssemblerOptions& options, unsigned threadCount) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        cerr << path << ": error: Socket path too long" << endl;
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    // Only a socket left behind by an earlier server is replaced
+    struct stat existing;
+    if (lstat(path.c_str(), &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            cerr << path << ": error: Exists and is not a socket" << endl;
+            return false;
+        }
+        unlink(path.c_str());
+    }
+    char* cwd = realpath(".", nullptr);
+    string root = cwd != nullptr ? cwd : "";
+    free(cwd);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int wakeup[2] = {-1, -1};   // workers write a byte to wakeup[1] when a request is done
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(listener, SOMAXCONN) != 0 || pipe2(wakeup, O_CLOEXEC | O_NONBLOCK) != 0) {
+        cerr << path << ": error: Cannot listen: " << strerror(errno) << endl;
+        for (int fd : {listener, wakeup[0], wakeup[1]}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        return false;
+    }
+    cout << "Listening on " << path << endl;
+
+    WorkStealingPool pool(threadCount);
+    list<ServeConnection> connections;
+    vector<pollfd> polled;
+    vector<ServeConnection*> polledConnections;
+    char chunk[65536];
+    for (;;) {
+        polled.assign({{listener, POLLIN, 0}, {wakeup[0], POLLIN, 0}});
+        polledConnections.clear();
+        for (ServeConnection& connection : connections) {
+            if (connection.busy.load(memory_order_acquire)) {
+                continue;
+            }
+            bool sending = connection.sent < connection.output.size();
+            if (sending || !connection.peerDone) {
+                polled.push_back({connection.fd, (short)(sending ? POLLOUT : POLLIN), 0});
+                polledConnections.push_back(&connection);
+            }
+        }
+        if (poll(polled.data(), polled.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            cerr << path << ": error: poll failed: " << strerror(errno) << endl;
+            break;
+        }
+        if (polled[0].revents & POLLIN) {
+            int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                connections.emplace_back().fd = fd;
+            } else if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+                cerr << path << ": error: accept failed: " << strerror(errno) << endl;
+                break;
+            }
+        }
+        if (polled[1].revents & POLLIN) {
+            while (read(wakeup[0], chunk, sizeof(chunk)) > 0) {
+            }
+        }
+        for (size_t i = 0; i < polledConnections.size(); i++) {
+            ServeConnection& connection = *polledConnections[i];
+            short events = polled[i + 2].revents;
+            if (events & POLLOUT) {
+                ssize_t count = send(connection.fd, connection.output.data() + connection.sent,
+                                     connection.output.size() - connection.sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (count > 0) {
+                    connection.sent += count;
+                } else if (count < 0 && errno != EINTR && errno != EAGAIN) {
+                    connection.peerDone = true;
+                    connection.closeAfterReply = true;
+                    connection.output.clear();
+                    connection.sent = 0;
+                }
+            } else if (events & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t count = recv(connection.fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+                if (count > 0) {
+                    connection.input.append(chunk, count);
+                } else if (count == 0 || (errno != EINTR && errno != EAGAIN)) {
+                    connection.peerDone = true;
+                }
+            }
+        }
+
+        // Hand the next request of every idle connection to the pool, and close the ones
+        // that are done
+        for (auto it = connections.begin(); it != connections.end();) {
+            ServeConnection& connection = *it;
+            if (connection.busy.load(memory_order_acquire) || connection.sent < connection.output.size()) {
+                ++it;
+                continue;
+            }
+            function<void(string&)> work;
+            if (!connection.closeAfterReply) {
+                work = takeRequest(connection, root, options);
+            }
+            if (!work) {
+                if (connection.peerDone || connection.closeAfterReply) {
+                    close(connection.fd);
+                    it = connections.erase(it);
+                    continue;
+                }
+                ++it;
+                continue;
+            }
+            connection.output.clear();
+            connection.sent = 0;
+            connection.busy.store(true, memory_order_relaxed);
+            int done = wakeup[1];
+            pool.submit([&connection, work, done] {
+                work(connection.output);
+                connection.busy.store(false, memory_order_release);
+                char byte = 0;
+                ssize_t ignored = write(done, &byte, 1);
+                (void)ignored;
+            });
+            ++it;
+        }
+    }
+    pool.wait();
+    for (ServeConnection& connection : connections) {
+        close(connection.fd);
+    }
+    close(wakeup[0]);
+    close(wakeup[1]);
+    close(listener);
+    return false;
+}
+
+// Decoding looks a word up by opcode, funct3 and the two funct7 bits that tell R format
+// instructions apart (bit 5 for sub and sra, bit 0 for the M extension), the way
+// findInstruction() hashes mnemonics. The low two opcode bits are 11 for every 32-bit
+// instruction, so they are left out of the key and checked against the entry instead.
+constexpr size_t DECODE_SLOTS = 1 << 10;
+
+constexpr size_t decodeKey(uint8_t opcode, uint8_t funct3, uint8_t funct7) {
+    return (size_t)(opcode >> 2) << 5 | funct3 << 2 | (funct7 >> 4 & 2) | (funct7 & 1);
+}
+
+constexpr array<int8_t, DECODE_SLOTS> buildDecodeSlots() {
+    array<int8_t, DECODE_SLOTS> slots{};
+    for (size_t i = 0; i < DECODE_SLOTS; i++) {
+        slots[i] = -1;
+    }
+    // U and UJ have no funct3, and only R format has a funct7: those fields are operand
+    // bits, so every value of them maps to the instruction
+    for (size_t i = 0; i < INSTRUCTION_COUNT; i++) {
+        const InstructionInfo& info = instructionTable[i];
+        bool anyFunct3 = info.format == U_FORMAT || info.format == UJ_FORMAT;
+        for (uint8_t funct3 = 0; funct3 < 8; funct3++) {
+            for (uint8_t funct7 : {0x00, 0x01, 0x20, 0x21}) {
+                if ((anyFunct3 || funct3 == info.funct3) &&
+                    (info.format != R_FORMAT || funct7 == info.funct7)) {
+                    slots[decodeKey(info.opcode, funct3, funct7)] = i;
+                }
+            }
+        }
+    }
+    return slots;
+}
+
+constexpr array<int8_t, DECODE_SLOTS> decodeSlots = buildDecodeSlots();
+
+constexpr bool decodeKeyIsUnique() {
+    for (size_t i = 0; i < INSTRUCTION_COUNT; i++) {
+        const InstructionInfo& info = instructionTable[i];
+        if (decodeSlots[decodeKey(info.opcode, info.funct3, info.funct7)] != (int8_t)i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(decodeKeyIsUnique(), "two instructions share a decode key, widen decodeKey()");
+
+// Finds the table entry a machine word was encoded from, or nullptr if none matches
+const InstructionInfo* decodeInstruction(uint32_t word) {
+    uint8_t opcode = word & 0x7F;
+    uint8_t funct7 = word >> 25;
+    int slot = decodeSlots[decodeKey(opcode, word >> 12 & 0x7, funct7)];
+    if (slot < 0) {
+        return nullptr;
+    }
+    const InstructionInfo& info = instructionTable[slot];
+    if (info.opcode != opcode || (info.format == R_FORMAT && info.funct7 != funct7)) {
+        return nullptr;
+    }
+    return &info;
+}
+
+// Sign-extended immediates of each format, the inverse of the encode*Format packing
+int32_t immediateI(uint32_t word) {
+    return (int32_t)word >> 20;
+}
+
+int32_t immediateS(uint32_t word) {
+    return ((int32_t)(word & 0xFE000000) >> 20) | (word >> 7 & 0x1F);
+}
+
+int32_t immediateSB(uint32_t word) {
+    return ((int32_t)(word & 0x80000000) >> 19) | (word << 4 & 0x800) | (word >> 20 & 0x7E0) |
+           (word >> 7 & 0x1E);
+}
+
+int32_t immediateU(uint32_t word) {
+    return (int32_t)(word & 0xFFFFF000);
+}
+
+int32_t immediateUJ(uint32_t word) {
+    return ((int32_t)(word & 0x80000000) >> 11) | (word & 0xFF000) | (word >> 9 & 0x800) |
+           (word >> 20 & 0x7FE);
+}
+
+void appendNumber(string& out, int64_t value, int base = 10) {
+    char text[24];
+    char* end = to_chars(text, text + sizeof(text), value, base).ptr;
+    out.append(text, end);
+}
+
+void appendRegister(string& out, uint32_t reg) {
+    out += " x";
+    appendNumber(out, reg);
+}
+
+// Appends word as a source line the assembler reads back to the same word: base
+// mnemonics only, numeric branch and jal offsets, and loads and stores written as
+// "lw rd imm rs1". Returns false, appending nothing, for words that are no instruction.
+bool disassembleInstruction(uint32_t word, string& out) {
+    const InstructionInfo* info = decodeInstruction(word);
+    if (info == nullptr) {
+        return false;
+    }
+    uint32_t rd = word >> 7 & 0x1F, rs1 = word >> 15 & 0x1F, rs2 = word >> 20 & 0x1F;
+    out += info->name;
+    switch (info->format) {
+        case R_FORMAT:
+            appendRegister(out, rd);
+            appendRegister(out, rs1);
+            appendRegister(out, rs2);
+            break;
+        case I_FORMAT:
+            appendRegister(out, rd);
+            if (info->opcode == 0b0000011) {
+                out += ' ';
+                appendNumber(out, immediateI(word));
+                appendRegister(out, rs1);
+            } else {
+                appendRegister(out, rs1);
+                out += ' ';
+                appendNumber(out, immediateI(word));
+            }
+            break;
+        case S_FORMAT:
+            appendRegister(out, rs2);
+            out += ' ';
+            appendNumber(out, immediateS(word));
+            appendRegister(out, rs1);
+            break;
+        case SB_FORMAT:
+            appendRegister(out, rs1);
+            appendRegister(out, rs2);
+            out += ' ';
+            appendNumber(out, immediateSB(word));
+            break;
+        case U_FORMAT:
+            appendRegister(out, rd);
+            out += ' ';
+            appendNumber(out, (uint32_t)immediateU(word) >> 12);
+            break;
+        case UJ_FORMAT:
+            appendRegister(out, rd);
+            out += ' ';
+            appendNumber(out, immediateUJ(word));
+            break;
+    }
+    return true;
+}
+
+// A program as the assembler writes it: text words from address 0 and data bytes from
+// DATA_BASE
+struct ProgramImage {
+    vector<uint32_t> text;
+    vector<uint8_t> data;
+};
+
+// Loads an output.mc listing (annotated or compact) or a --binary image. The first
+// 0xdeadbeef word ends the text segment.
+bool loadProgramImage(const string& path, ProgramImage& image, string& error) {
+    SourceFile file(path);
+    if (!file.isOpen()) {
+        error = "Cannot open " + path;
+        return false;
+    }
+    string_view contents = file.text();
+    if (contents.substr(0, 2) != "0x") {
+        size_t words = contents.size() / 4;
+        size_t i = 0;
+        for (; i < words; i++) {
+            uint32_t word;
+            memcpy(&word, contents.data() + 4 * i, 4);
+            if (word == 0xdeadbeef) {
+                break;
+            }
+            image.text.push_back(word);
+        }
+        image.data.assign(contents.begin() + min(contents.size(), 4 * (i + 1)), contents.end());
+        return true;
+    }
+
+    string_view line;
+    bool inText = true;
+    while (nextLine(contents, line)) {
+        string_view rest = line;
+        string_view address = nextToken(rest);
+        string_view value = nextToken(rest);
+        unsigned long long addressValue = 0, valueValue = 0;
+        if (address.size() < 3 || value.size() < 3 ||
+            from_chars(address.data() + 2, address.data() + address.size(), addressValue, 16).ec != errc() ||
+            from_chars(value.data() + 2, value.data() + value.size(), valueValue, 16).ec != errc()) {
+            continue;
+        }
+        if (inText) {
+            if (valueValue == 0xdeadbeef) {
+                inText = false;
+                continue;
+            }
+            image.text.resize(max<size_t>(image.text.size(), addressValue / 4 + 1));
+            image.text[addressValue / 4] = valueValue;
+        } else if (addressValue >= (unsigned long long)DATA_BASE) {
+            size_t offset = addressValue - DATA_BASE;
+            image.data.resize(max(image.data.size(), offset + 1));
+            image.data[offset] = valueValue;
+        }
+    }
+    return true;
+}
+
+// Sparse byte-addressed memory made of 4 KiB pages, with a small direct-mapped cache of
+// page pointers in front of the page map
+class SimulatorMemory {
+public:
+    template <typename T>
+    T load(uint64_t address) {
+        T value;
+        if ((address & PAGE_MASK) + sizeof(T) <= PAGE_SIZE) {
+            memcpy(&value, page(address) + (address & PAGE_MASK), sizeof(T));
+        } else {
+            uint8_t bytes[sizeof(T)];
+            for (size_t i = 0; i < sizeof(T); i++) {
+                bytes[i] = page(address + i)[(address + i) & PAGE_MASK];
+            }
+            memcpy(&value, bytes, sizeof(T));
+        }
+        return value;
+    }
+
+    template <typename T>
+    void store(uint64_t address, T value) {
+        if ((address & PAGE_MASK) + sizeof(T) <= PAGE_SIZE) {
+            memcpy(page(address) + (address & PAGE_MASK), &value, sizeof(T));
+        } else {
+            uint8_t bytes[sizeof(T)];
+            memcpy(bytes, &value, sizeof(T));
+            for (size_t i = 0; i < sizeof(T); i++) {
+                page(address + i)[(address + i) & PAGE_MASK] = bytes[i];
+            }
+        }
+    }
+
+private:
+    static constexpr uint64_t PAGE_SIZE = 4096;
+    static constexpr uint64_t PAGE_MASK = PAGE_SIZE - 1;
+    static constexpr size_t CACHE_SIZE = 64;
+
+    uint8_t* page(uint64_t address) {
+        uint64_t number = address / PAGE_SIZE;
+        CachedPage& cached = cache[number % CACHE_SIZE];
+        if (cached.data == nullptr || cached.number != number) {
+            unique_ptr<uint8_t[]>& slot = pages[number];
+            if (!slot) {
+                slot = make_unique<uint8_t[]>(PAGE_SIZE);
+            }
+            cached.number = number;
+            cached.data = slot.get();
+        }
+        return cached.data;
+    }
+
+    struct CachedPage {
+        uint64_t number = 0;
+        uint8_t* data = nullptr;
+    };
+
+    unordered_map<uint64_t, unique_ptr<uint8_t[]>> pages;
+    array<CachedPage, CACHE_SIZE> cache;
+};
+
+// One text word with its fields already pulled out
+struct DecodedInstruction {
+    uint8_t handler;    // Operation, or HALT / ILLEGAL below
+    uint8_t rd;         // 32 stands in for x0 so writes to it are simply discarded
+    uint8_t rs1;
+    uint8_t rs2;
+    int32_t imm;
+};
+
+const uint8_t HANDLER_HALT = INSTRUCTION_COUNT;
+const uint8_t HANDLER_ILLEGAL = INSTRUCTION_COUNT + 1;
+
+const uint64_t STACK_POINTER = 0x7FFFFFDC;
+
+// Simulator::run() observer for plain runs, which compiles away
+struct NoObserver {
+    void retire(uint64_t, const DecodedInstruction&, uint64_t) {}
+};
+
+// Functional RV64 model of the instructions in instructionTable. Every text word is
+// decoded once up front; the run loop then only switches on the handler number.
+class Simulator {
+public:
+    explicit Simulator(const ProgramImage& image) {
+        for (uint32_t word : image.text) {
+            code.push_back(predecode(word));
+        }
+        code.push_back({HANDLER_HALT, 32, 0, 0, 0});   // falling off the end stops the run
+        for (size_t i = 0; i < image.text.size(); i++) {
+            memory.store<uint32_t>(4 * i, image.text[i]);
+        }
+        for (size_t i = 0; i < image.data.size(); i++) {
+            memory.store<uint8_t>(DATA_BASE + i, image.data[i]);
+        }
+        regs[2] = STACK_POINTER;
+        regs[3] = DATA_BASE;
+    }
+
+    // Runs until the program leaves the text segment or maxSteps instructions have run.
+    // Returns an empty string on a normal halt, otherwise why the run stopped.
+    string run(uint64_t maxSteps) {
+        NoObserver none;
+        return run(maxSteps, none);
+    }
+
+    // The same, handing observer.retire() the pc, the decoded instruction and the next pc
+    // of every instruction once it has executed
+    template <typename Observer>
+    string run(uint64_t maxSteps, Observer& observer) {
+        int64_t* x = regs;
+        const DecodedInstruction* text = code.data();
+        uint64_t textSize = code.size() * 4;
+        uint64_t pc = this->pc;
+        uint64_t steps = 0;
+        string stop;
+
+        while (steps < maxSteps) {
+            if (pc >= textSize || (pc & 3) != 0) {
+                stop = "pc out of the text segment: 0x" + toHex(pc);
+                break;
+            }
+            const DecodedInstruction& in = text[pc >> 2];
+            uint64_t next = pc + 4;
+            switch (in.handler) {
+                case OP_ADD: x[in.rd] = x[in.rs1] + x[in.rs2]; break;
+                case OP_SUB: x[in.rd] = x[in.rs1] - x[in.rs2]; break;
+                case OP_AND: x[in.rd] = x[in.rs1] & x[in.rs2]; break;
+                case OP_OR:  x[in.rd] = x[in.rs1] | x[in.rs2]; break;
+                case OP_XOR: x[in.rd] = x[in.rs1] ^ x[in.rs2]; break;
+                case OP_SLL: x[in.rd] = (uint64_t)x[in.rs1] << (x[in.rs2] & 63); break;
+                case OP_SRL: x[in.rd] = (uint64_t)x[in.rs1] >> (x[in.rs2] & 63); break;
+                case OP_SRA: x[in.rd] = x[in.rs1] >> (x[in.rs2] & 63); break;
+                case OP_SLT: x[in.rd] = x[in.rs1] < x[in.rs2]; break;
+                case OP_MUL: x[in.rd] = (uint64_t)x[in.rs1] * (uint64_t)x[in.rs2]; break;
+                case OP_DIV: x[in.rd] = divide(x[in.rs1], x[in.rs2]); break;
+                case OP_REM: x[in.rd] = remainder(x[in.rs1], x[in.rs2]); break;
+                case OP_ADDI: x[in.rd] = x[in.rs1] + in.imm; break;
+                case OP_ANDI: x[in.rd] = x[in.rs1] & in.imm; break;
+                case OP_ORI:  x[in.rd] = x[in.rs1] | in.imm; break;
+                case OP_JALR: next = (x[in.rs1] + in.imm) & ~1ULL; x[in.rd] = pc + 4; break;
+                case OP_LB: x[in.rd] = memory.load<int8_t>(x[in.rs1] + in.imm); break;
+                case OP_LH: x[in.rd] = memory.load<int16_t>(x[in.rs1] + in.imm); break;
+                case OP_LW: x[in.rd] = memory.load<int32_t>(x[in.rs1] + in.imm); break;
+                case OP_LD: x[in.rd] = memory.load<int64_t>(x[in.rs1] + in.imm); break;
+                case OP_SB: memory.store<uint8_t>(x[in.rs1] + in.imm, x[in.rs2]); break;
+                case OP_SH: memory.store<uint16_t>(x[in.rs1] + in.imm, x[in.rs2]); break;
+                case OP_SW: memory.store<uint32_t>(x[in.rs1] + in.imm, x[in.rs2]); break;
+                case OP_SD: memory.store<uint64_t>(x[in.rs1] + in.imm, x[in.rs2]); break;
+                case OP_BEQ: if (x[in.rs1] == x[in.rs2]) next = pc + in.imm; break;
+                case OP_BNE: if (x[in.rs1] != x[in.rs2]) next = pc + in.imm; break;
+                case OP_BGE: if (x[in.rs1] >= x[in.rs2]) next = pc + in.imm; break;
+                case OP_BLT: if (x[in.rs1] < x[in.rs2]) next = pc + in.imm; break;
+                case OP_AUIPC: x[in.rd] = pc + in.imm; break;
+                case OP_LUI: x[in.rd] = in.imm; break;
+                case OP_JAL: x[in.rd] = pc + 4; next = pc + in.imm; break;
+                case HANDLER_HALT:
+                    this->pc = pc;
+                    instructionCount += steps;
+                    return "";
+                default:
+                    stop = "illegal instruction at 0x" + toHex(pc);
+                    next = pc;
+                    maxSteps = steps;
+                    break;
+            }
+            observer.retire(pc, in, next);
+            pc = next;
+            steps++;
+        }
+        if (stop.empty()) {
+            stop = "step limit reached";
+        }
+        this->pc = pc;
+        instructionCount += steps;
+        return stop;
+    }
+
+    int64_t reg(int index) const {
+        return regs[index];
+    }
+
+    uint64_t pc = 0;
+    uint64_t instructionCount = 0;
+
+private:
+    static DecodedInstruction predecode(uint32_t word) {
+        DecodedInstruction decoded = {HANDLER_ILLEGAL, 32, 0, 0, 0};
+        const InstructionInfo* info = decodeInstruction(word);
+        if (info == nullptr) {
+            return decoded;
+        }
+        decoded.handler = info->operation;
+        uint8_t rd = word >> 7 & 0x1F;
+        decoded.rs1 = word >> 15 & 0x1F;
+        decoded.rs2 = word >> 20 & 0x1F;
+        switch (info->format) {
+            case R_FORMAT:  decoded.rd = rd; break;
+            case I_FORMAT:  decoded.rd = rd; decoded.imm = immediateI(word); break;
+            case S_FORMAT:  decoded.imm = immediateS(word); break;
+            case SB_FORMAT: decoded.imm = immediateSB(word); break;
+            case U_FORMAT:  decoded.rd = rd; decoded.imm = immediateU(word); break;
+            case UJ_FORMAT: decoded.rd = rd; decoded.imm = immediateUJ(word); break;
+        }
+        if (decoded.rd == 0) {
+            decoded.rd = 32;
+        }
+        return decoded;
+    }
+
+    static int64_t divide(int64_t a, int64_t b) {
+        if (b == 0) {
+            return -1;
+        }
+        if (a == INT64_MIN && b == -1) {
+            return a;
+        }
+        return a / b;
+    }
+
+    static int64_t remainder(int64_t a, int64_t b) {
+        if (b == 0) {
+            return a;
+        }
+        if (a == INT64_MIN && b == -1) {
+            return 0;
+        }
+        return a % b;
+    }
+
+    static string toHex(uint64_t value) {
+        char text[17];
+        snprintf(text, sizeof(text), "%llx", (unsigned long long)value);
+        return text;
+    }
+
+    vector<DecodedInstruction> code;
+    SimulatorMemory memory;
+    int64_t regs[33] = {};     // x0..x31 plus the x0 write sink
+};
+
+enum PredictorKind { PREDICT_STATIC, PREDICT_ONE_BIT, PREDICT_TWO_BIT, PREDICT_BTB };
+const char* const predictorNames[] = {"static", "1bit", "2bit", "btb"};
+
+struct PipelineConfig {
+    bool forwarding = true;
+    PredictorKind predictor = PREDICT_TWO_BIT;
+};
+
+enum StallCause { STALL_DATA, STALL_LOAD_USE, STALL_BRANCH, STALL_JUMP, STALL_CAUSE_COUNT };
+const char* const stallCauseNames[] = {"data", "load-use", "branch", "jump"};
+
+// Text labels as (address, name), sorted by address
+typedef vector<pair<uint64_t, string>> LabelList;
+
+// Nearest label at or before pc as "label+offset", empty if there is none
+string locateLabel(const LabelList& labels, uint64_t pc) {
+    auto after = upper_bound(labels.begin(), labels.end(), pc,
+                             [](uint64_t address, const pair<uint64_t, string>& label) { return address < label.first; });
+    if (after == labels.begin()) {
+        return "";
+    }
+    --after;
+    return pc == after->first ? after->second : after->second + "+" + to_string(pc - after->first);
+}
+
+// Cycle count of a classic 5-stage pipeline (IF, ID, EX, MEM, WB) fed with the instructions
+// the functional simulator retires. Each instruction enters EX the cycle after the previous
+// one unless one of its sources is not ready or fetch went the wrong way:
+//  - with forwarding an ALU result reaches the very next EX and a load result the one
+//    after (a load-use stall); without it a value is read in ID, in the producer's WB
+//    cycle at the earliest
+//  - branches and jalr resolve in EX, so a wrong guess flushes two instructions; jal, and
+//    a taken branch whose target the BTB does not supply, redirect fetch from ID for one
+class PipelineModel {
+public:
+    PipelineModel(const PipelineConfig& config, const ProgramImage& image)
+        : config(config), text(image.text), cycles(image.text.size()), executed(image.text.size()),
+          sites(image.text.size()), targets(image.text.size()), counters(PREDICTOR_ENTRIES, config.predictor == PREDICT_ONE_BIT ? 0 : 1),
+          btb(BTB_ENTRIES) {}
+
+    void retire(uint64_t pc, const DecodedInstruction& in, uint64_t next) {
+        if (in.handler >= INSTRUCTION_COUNT) {
+            return;
+        }
+        const InstructionInfo& info = instructionTable[in.handler];
+        uint64_t ex = lastEx + 1;
+        if (redirect > ex) {
+            stalls[redirectCause] += redirect - ex;
+            ex = redirect;
+        }
+        switch (info.format) {
+            case R_FORMAT:
+            case SB_FORMAT:
+                waitFor(in.rs1, 0, ex);
+                waitFor(in.rs2, 0, ex);
+                break;
+            case I_FORMAT:
+                waitFor(in.rs1, 0, ex);
+                break;
+            case S_FORMAT:
+                // Store data is only needed in MEM, in time for a forwarded load result
+                waitFor(in.rs1, 0, ex);
+                waitFor(in.rs2, config.forwarding ? 1 : 0, ex);
+                break;
+            case U_FORMAT:
+            case UJ_FORMAT:
+                break;
+        }
+        if (in.rd != 32) {
+            bool load = info.opcode == 0b0000011;
+            ready[in.rd] = ex + (!config.forwarding ? 3 : load ? 2 : 1);
+            loaded[in.rd] = load;
+        }
+        if (info.format == SB_FORMAT || in.handler == OP_JAL || in.handler == OP_JALR) {
+            int penalty = controlPenalty(pc, in, next);
+            redirect = ex + 1 + penalty;
+            redirectCause = info.format == SB_FORMAT ? STALL_BRANCH : STALL_JUMP;
+        }
+        cycles[pc >> 2] += ex - lastEx;
+        executed[pc >> 2]++;
+        instructions++;
+        lastEx = ex;
+    }
+
+    void report(ostream& out, const LabelList& labels) const {
+        uint64_t total = instructions == 0 ? 0 : lastEx + 2;   // the last instruction still has MEM and WB
+        out << "Pipeline: 5 stages, forwarding " << (config.forwarding ? "on" : "off") << ", "
+            << predictorNames[config.predictor] << " branch predictor" << endl;
+        out << "Cycles: " << total << " for " << instructions << " instructions, CPI " << fixed << setprecision(3)
+            << (instructions == 0 ? 0.0 : (double)total / instructions) << endl;
+        uint64_t stallTotal = 0;
+        out << "Stall cycles:";
+        for (int cause = 0; cause < STALL_CAUSE_COUNT; cause++) {
+            out << (cause == 0 ? " " : ", ") << stallCauseNames[cause] << " " << stalls[cause];
+            stallTotal += stalls[cause];
+        }
+        out << " (" << stallTotal << " in all)" << endl;
+
+        vector<size_t> branches;
+        uint64_t branchCount = 0, mispredicted = 0;
+        for (size_t i = 0; i < sites.size(); i++) {
+            if (sites[i].executed > 0) {
+                branches.push_back(i);
+                branchCount += sites[i].executed;
+                mispredicted += sites[i].mispredicted;
+            }
+        }
+        out << "Branches: " << branchCount << " executed, " << mispredicted << " mispredicted ("
+            << setprecision(1) << percent(mispredicted, branchCount) << "%)" << endl;
+        stable_sort(branches.begin(), branches.end(),
+                    [&](size_t a, size_t b) { return sites[a].mispredicted > sites[b].mispredicted; });
+        for (size_t k = 0; k < branches.size() && k < REPORT_ROWS; k++) {
+            const BranchSite& site = sites[branches[k]];
+            string line;
+            disassembleInstruction(text[branches[k]], line);
+            out << "  " << hexAddress(4 * branches[k]) << "  " << left << setw(20) << line << right << " executed " << site.executed << ", taken " << site.taken
+                << ", mispredicted " << site.mispredicted << " (" << percent(site.mispredicted, site.executed) << "%)";
+            string where = locateLabel(labels, 4 * branches[k]);
+            out << (where.empty() ? "" : "  " + where) << endl;
+        }
+        if (branches.size() > REPORT_ROWS) {
+            out << "  (" << branches.size() - REPORT_ROWS << " more branch sites)" << endl;
+        }
+
+        // Code runs from each label, or each unlabelled jump target, up to the next one
+        map<uint64_t, string> starts = {{0, hexAddress(0)}};
+        for (size_t i = 0; i < targets.size(); i++) {
+            if (targets[i]) {
+                starts[4 * i] = hexAddress(4 * i);
+            }
+        }
+        for (const auto& label : labels) {
+            starts[label.first] = label.second;
+        }
+        struct HotSpot {
+            const string* name;
+            uint64_t cycles = 0, instructions = 0;
+        };
+        map<uint64_t, HotSpot> spots;
+        for (size_t i = 0; i < executed.size(); i++) {
+            if (executed[i] > 0) {
+                auto start = prev(starts.upper_bound(4 * i));
+                HotSpot& spot = spots[start->first];
+                spot.name = &start->second;
+                spot.cycles += cycles[i];
+                spot.instructions += executed[i];
+            }
+        }
+        vector<const HotSpot*> ranked;
+        for (const auto& entry : spots) {
+            ranked.push_back(&entry.second);
+        }
+        stable_sort(ranked.begin(), ranked.end(), [](const HotSpot* a, const HotSpot* b) { return a->cycles > b->cycles; });
+        out << "Hot spots:" << endl;
+        for (size_t k = 0; k < ranked.size() && k < REPORT_ROWS; k++) {
+            out << "  " << left << setw(20) << *ranked[k]->name << right << " " << ranked[k]->cycles << " cycles ("
+                << percent(ranked[k]->cycles, total) << "%), " << ranked[k]->instructions << " instructions, "
+                << ranked[k]->cycles - ranked[k]->instructions << " stall cycles" << endl;
+        }
+    }
+
+private:
+    static constexpr size_t PREDICTOR_ENTRIES = 1024;
+    static constexpr size_t BTB_ENTRIES = 256;
+    static constexpr size_t REPORT_ROWS = 20;
+
+    struct BranchSite {
+        uint64_t executed = 0, taken = 0, mispredicted = 0;
+    };
+
+    struct BtbEntry {
+        bool valid = false;
+        uint64_t pc = 0, target = 0;
+    };
+
+    static string hexAddress(uint64_t address) {
+        char text[19];
+        snprintf(text, sizeof(text), "0x%08llx", (unsigned long long)address);
+        return text;
+    }
+
+    static double percent(uint64_t part, uint64_t whole) {
+        return whole == 0 ? 0.0 : 100.0 * part / whole;
+    }
+
+    // Holds the instruction entering EX at ex back until reg can be used stage cycles later
+    void waitFor(uint8_t reg, uint64_t stage, uint64_t& ex) {
+        if (reg != 0 && ready[reg] > ex + stage) {
+            uint64_t wait = ready[reg] - ex - stage;
+            stalls[loaded[reg] && config.forwarding ? STALL_LOAD_USE : STALL_DATA] += wait;
+            ex += wait;
+        }
+    }
+
+    // Cycles fetch loses behind the branch or jump at pc, which went on to next
+    int controlPenalty(uint64_t pc, const DecodedInstruction& in, uint64_t next) {
+        BtbEntry& entry = btb[(pc >> 2) % BTB_ENTRIES];
+        bool hit = config.predictor == PREDICT_BTB && entry.valid && entry.pc == pc;
+        bool taken = next != pc + 4;
+        int penalty;
+        if (in.handler == OP_JAL || in.handler == OP_JALR) {
+            // jal's target is known in ID, jalr's only in EX
+            penalty = hit && entry.target == next ? 0 : in.handler == OP_JAL ? 1 : 2;
+        } else {
+            uint8_t& counter = counters[(pc >> 2) % PREDICTOR_ENTRIES];
+            bool predictTaken;
+            if (config.predictor == PREDICT_STATIC) {
+                predictTaken = in.imm < 0;     // backward taken, forward not taken
+            } else if (config.predictor == PREDICT_ONE_BIT) {
+                predictTaken = counter != 0;
+                counter = taken;
+            } else {
+                predictTaken = counter >= 2;
+                if (taken && counter < 3) {
+                    counter++;
+                } else if (!taken && counter > 0) {
+                    counter--;
+                }
+            }
+            BranchSite& site = sites[pc >> 2];
+            site.executed++;
+            site.taken += taken;
+            site.mispredicted += predictTaken != taken;
+            penalty = predictTaken != taken ? 2 : taken && !hit ? 1 : 0;
+        }
+        if (taken) {
+            if ((next >> 2) < targets.size()) {
+                targets[next >> 2] = true;
+            }
+            if (config.predictor == PREDICT_BTB) {
+                entry = {true, pc, next};
+            }
+        }
+        return penalty;
+    }
+
+    PipelineConfig config;
+    const vector<uint32_t>& text;
+    uint64_t lastEx = 2;          // EX cycle of the last instruction; the first one reaches EX in cycle 3
+    uint64_t redirect = 0;        // earliest EX cycle for the instruction fetched after a branch or jump
+    StallCause redirectCause = STALL_BRANCH;
+    uint64_t ready[33] = {};      // first EX cycle that can use each register's new value
+    bool loaded[33] = {};         // whether that value comes from a load
+    uint64_t instructions = 0;
+    uint64_t stalls[STALL_CAUSE_COUNT] = {};
+    vector<uint64_t> cycles;      // per text word: cycles since the previous instruction entered EX
+    vector<uint64_t> executed;
+    vector<BranchSite> sites;
+    vector<bool> targets;         // words some branch or jump went to
+    vector<uint8_t> counters;     // 1-bit or 2-bit branch history, indexed by pc
+    vector<BtbEntry> btb;
+};
+
+// Loads an assembled program, runs it and prints the outcome and the non-zero registers.
+// With a pipeline config the run also goes through the timing model, whose report names
+// code after labels when there are any.
+bool simulateProgram(const string& imagePath, uint64_t maxSteps, const PipelineConfig* pipeline = nullptr,
+                     const LabelList& labels = {}) {
+    ProgramImage image;
+    string error;
+    if (!loadProgramImage(imagePath, image, error)) {
+        cerr << imagePath << ": error: " << error << endl;
+        return false;
+    }
+    Simulator simulator(image);
+    unique_ptr<PipelineModel> model;
+    if (pipeline != nullptr) {
+        model = make_unique<PipelineModel>(*pipeline, image);
+    }
+    auto start = chrono::steady_clock::now();
+    string stop = model ? simulator.run(maxSteps, *model) : simulator.run(maxSteps);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    if (!stop.empty()) {
+        cout << "Simulation stopped: " << stop << endl;
+    }
+    cout << "Executed " << dec << simulator.instructionCount << " instructions in "
+         << fixed << setprecision(3) << seconds * 1000 << " ms";
+    if (seconds > 0) {
+        cout << " (" << setprecision(1) << simulator.instructionCount / seconds / 1e6 << " MIPS)";
+    }
+    cout << endl;
+    for (int i = 1; i < 32; i++) {
+        if (simulator.reg(i) != 0) {
+            cout << "x" << i << " = " << simulator.reg(i) << " (0x" << hex << (uint64_t)simulator.reg(i)
+                 << dec << ")" << endl;
+        }
+    }
+    if (model) {
+        model->report(cout, labels);
+    }
+    return stop.empty();
+}
+
+// --disassemble: prints the image as source the assembler accepts, each line followed by
+// the address and word it came from. Words that are no instruction come out as .word
+// lines, which the assembler does not take back.
+bool disassembleProgram(const string& imagePath) {
+    ProgramImage image;
+    string error;
+    if (!loadProgramImage(imagePath, image, error)) {
+        cerr << imagePath << ": error: " << error << endl;
+        return false;
+    }
+    string out = ".text\n";
+    for (size_t i = 0; i < image.text.size(); i++) {
+        uint32_t word = image.text[i];
+        if (!disassembleInstruction(word, out)) {
+            out += ".word 0x";
+            appendNumber(out, word, 16);
+        }
+        out += " # 0x";
+        appendNumber(out, 4 * i, 16);
+        out += " 0x";
+        for (int shift = 28; shift >= 0; shift -= 4) {
+            out += "0123456789abcdef"[word >> shift & 0xF];
+        }
+        out += '\n';
+        if (out.size() >= (1 << 16)) {
+            fwrite(out.data(), 1, out.size(), stdout);
+            out.clear();
+        }
+    }
+    if (!image.data.empty()) {
+        out += ".data\n";
+    }
+    // Data lines have to start with a label
+    for (size_t i = 0; i < image.data.size(); i += 16) {
+        out += "data";
+        appendNumber(out, i);
+        out += ": .byte";
+        for (size_t j = i; j < min(image.data.size(), i + 16); j++) {
+            out += ' ';
+            appendNumber(out, image.data[j]);
+        }
+        out += '\n';
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    return true;
+}
+
+// Disassembles word, assembles the text again and checks that gives back word. When word
+// was encoded from info and immediate (either may be null), it must also decode to them.
+// On a mismatch text holds the disassembly.
+bool roundTripWord(AssemblerContext& ctx, uint32_t word, const InstructionInfo* info, const int32_t* immediate,
+                   string& text) {
+    text.clear();
+    const InstructionInfo* decoded = decodeInstruction(word);
+    if (decoded == nullptr) {
+        return info == nullptr;
+    }
+    disassembleInstruction(word, text);
+    if (info != nullptr && decoded != info) {
+        return false;
+    }
+    if (immediate != nullptr) {
+        InstructionFormat format = decoded->format;
+        int32_t value = format == I_FORMAT    ? immediateI(word)
+                        : format == S_FORMAT  ? immediateS(word)
+                        : format == SB_FORMAT ? immediateSB(word)
+                        : format == UJ_FORMAT ? immediateUJ(word)
+                                              : (int32_t)((uint32_t)immediateU(word) >> 12);
+        if (value != *immediate) {
+            return false;
+        }
+    }
+    IrInstruction ir;
+    EncodedLine encoded;
+    size_t errorsBefore = ctx.diagnostics.count();
+    ctx.diagnostics.setLine(text, 1);
+    parseInstruction(ctx.symbols, ctx.diagnostics, text, ir);
+    ir.address = 0;
+    encodeInstruction(ctx.symbols, ctx.diagnostics, ir, text, encoded, false);
+    bool same = ctx.diagnostics.count() == errorsBefore && encoded.valid && encoded.words == 1 &&
+                encoded.machineCode[0] == word;
+    ctx.diagnostics.entries.resize(errorsBefore);
+    return same;
+}
+
+// --round-trip: runs every instruction in the table through encoder, disassembler and
+// assembler again, sweeping the whole immediate range of its format (every register
+// combination for R) with random registers, then randomWords random words. Prints the
+// first mismatches and returns whether there were none.
+bool roundTripEncoders(uint64_t randomWords, uint64_t seed) {
+    AssemblerContext ctx;
+    mt19937_64 random(seed);
+    string text;
+    uint64_t words = 0, mismatches = 0;
+    auto check = [&](uint32_t word, const InstructionInfo* info, const int32_t* immediate) {
+        words++;
+        if (!roundTripWord(ctx, word, info, immediate, text)) {
+            if (++mismatches <= 10) {
+                cerr << "Mismatch: 0x" << hex << setw(8) << setfill('0') << word << dec << setfill(' ')
+                     << " disassembles to \"" << text << "\"" << endl;
+            }
+        }
+    };
+    auto start = chrono::steady_clock::now();
+    for (const InstructionInfo& info : instructionTable) {
+        auto encode = [&](int32_t immediate) {
+            uint32_t fields = random();
+            MachineInstruction op = {&info, (uint8_t)(fields & 0x1F), (uint8_t)(fields >> 5 & 0x1F),
+                                     (uint8_t)(fields >> 10 & 0x1F), (uint32_t)immediate};
+            check(encodeMachineInstruction(op, nullptr), &info, &immediate);
+        };
+        switch (info.format) {
+            case R_FORMAT:
+                for (uint32_t regs = 0; regs < 1 << 15; regs++) {
+                    MachineInstruction op = {&info, (uint8_t)(regs & 0x1F), (uint8_t)(regs >> 5 & 0x1F),
+                                             (uint8_t)(regs >> 10), 0};
+                    check(encodeMachineInstruction(op, nullptr), &info, nullptr);
+                }
+                break;
+            case I_FORMAT:
+            case S_FORMAT:
+                for (int32_t immediate = -2048; immediate < 2048; immediate++) {
+                    encode(immediate);
+                }
+                break;
+            // Instructions are word aligned, so the encoders clear bit 1 of branch and jal
+            // offsets as well
+            case SB_FORMAT:
+                for (int32_t offset = -4096; offset < 4096; offset += 4) {
+                    encode(offset);
+                }
+                break;
+            case U_FORMAT:
+                for (int32_t immediate = 0; immediate < 1 << 20; immediate++) {
+                    encode(immediate);
+                }
+                break;
+            case UJ_FORMAT:
+                for (int32_t offset = -(1 << 20); offset < 1 << 20; offset += 4) {
+                    encode(offset);
+                }
+                break;
+        }
+    }
+    for (uint64_t i = 0; i < randomWords; i++) {
+        uint32_t word = random();
+        if ((word & 0x7F) == instructionTable[OP_BEQ].opcode) {
+            word &= ~branchOffsetBits(2);
+        } else if ((word & 0x7F) == instructionTable[OP_JAL].opcode) {
+            word &= ~jalOffsetBits(2);
+        }
+        check(word, nullptr, nullptr);
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "Round trip: " << words << " words, " << mismatches << " mismatches in " << fixed
+         << setprecision(3) << seconds << " s";
+    if (seconds > 0) {
+        cout << " (" << setprecision(1) << words / seconds / 1e6 << " M words/s)";
+    }
+    cout << endl;
+    return mismatches == 0;
+}
+
+// Knobs for the synthetic programs used by --generate and --bench
+struct WorkloadOptions {
+    uint64_t seed = 1;
+    size_t lines = 1000000;                        // instructions in the text segment
+    array<double, 6> mix = {30, 30, 10, 15, 5, 10};   // weights of R, I, S, SB, U, UJ
+    double labelDensity = 0.05;                    // chance of a label before an instruction
+    int branchDistance = 256;                      // furthest a branch or jal reaches, in instructions
+    double dataRatio = 0.01;                       // data directives per instruction
+};
+
+// Generates a program that assembles cleanly, so every run exercises the same code paths
+string generateWorkload(const WorkloadOptions& options) {
+    static const char* rFormat[] = {"add", "sub", "and", "or", "sll", "slt", "sra", "srl", "xor", "mul", "div", "rem"};
+    static const char* iFormat[] = {"addi", "andi", "ori"};
+    static const char* loads[] = {"lb", "lh", "lw", "ld"};
+    static const char* sFormat[] = {"sb", "sh", "sw", "sd"};
+    static const char* sbFormat[] = {"beq", "bne", "bge", "blt"};
+    mt19937_64 random(options.seed);
+    auto pick = [&](int count) { return (int)(random() % count); };
+    auto reg = [&]() { return (int)(random() % 32); };
+    auto imm12 = [&]() { return (int)(random() % 4096) - 2048; };
+    discrete_distribution<int> format(options.mix.begin(), options.mix.end());
+    bernoulli_distribution hasLabel(options.labelDensity);
+    bernoulli_distribution hasData(options.dataRatio);
+
+    vector<size_t> labelPositions;
+    for (size_t i = 0; i < options.lines; i++) {
+        if (hasLabel(random)) {
+            labelPositions.push_back(i);
+        }
+    }
+
+    // Nearest label at or after the requested target, or a plain offset if none is in reach
+    auto branchTarget = [&](size_t position, long reach, char* text, size_t size) {
+        long distance = options.branchDistance;
+        long target = (long)position + (long)(random() % (2 * distance + 1)) - distance;
+        target = max(0L, min<long>(target, options.lines));
+        auto it = lower_bound(labelPositions.begin(), labelPositions.end(), (size_t)target);
+        if (it != labelPositions.end() && labs((long)*it - (long)position) <= reach) {
+            snprintf(text, size, "L%zu", *it);
+        } else {
+            long offset = max(-reach, min(reach, target - (long)position));
+            snprintf(text, size, "%ld", offset * 4);
+        }
+    };
+
+    string source;
+    source.reserve(options.lines * 24);
+    char line[128];
+    char target[32];
+    size_t nextLabel = 0;
+    for (size_t i = 0; i < options.lines; i++) {
+        if (nextLabel < labelPositions.size() && labelPositions[nextLabel] == i) {
+            snprintf(line, sizeof(line), (i & 1) ? "L%zu:\n" : "L%zu: ", i);
+            source += line;
+            nextLabel++;
+        }
+        switch (format(random)) {
+            case 0:
+                snprintf(line, sizeof(line), "%s x%d, x%d, x%d\n", rFormat[pick(12)], reg(), reg(), reg());
+                break;
+            case 1:
+                if (pick(2) == 0) {
+                    snprintf(line, sizeof(line), "%s x%d x%d %d\n", iFormat[pick(3)], reg(), reg(), imm12());
+                } else if (pick(2) == 0) {
+                    snprintf(line, sizeof(line), "%s x%d %d(x%d)\n", loads[pick(4)], reg(), imm12(), reg());
+                } else {
+                    snprintf(line, sizeof(line), "jalr x%d x%d %d\n", reg(), reg(), imm12());
+                }
+                break;
+            case 2:
+                snprintf(line, sizeof(line), "%s x%d, %d(x%d)\n", sFormat[pick(4)], reg(), imm12(), reg());
+                break;
+            case 3:
+                branchTarget(i, 1023, target, sizeof(target));
+                snprintf(line, sizeof(line), "%s x%d x%d %s\n", sbFormat[pick(4)], reg(), reg(), target);
+                break;
+            case 4:
+                snprintf(line, sizeof(line), "%s x%d 0x%x\n", pick(2) ? "lui" : "auipc", reg(), pick(1 << 20));
+                break;
+            default:
+                branchTarget(i, 262143, target, sizeof(target));
+                snprintf(line, sizeof(line), "jal x%d %s\n", reg(), target);
+                break;
+        }
+        source += line;
+        if (hasData(random)) {
+            static const char* directives[] = {".byte 1 2 3 4", ".half 300 -2", ".word 0x1234 -7 0b101",
+                                               ".dword 123456789 -1", ".asciz \"generated\""};
+            snprintf(line, sizeof(line), ".data\nd%zu: %s\n.text\n", i, directives[pick(5)]);
+            source += line;
+        }
+    }
+    return source;
+}
+
+bool writeFile(const string& path, string_view contents) {
+    ofstream out(path, ios::binary);
+    out.write(contents.data(), contents.size());
+    return (bool)out;
+}
+
+struct PhaseResult {
+    double seconds = 0;
+    uint64_t bytes = 0;
+    uint64_t allocations = 0;
+};
+
+struct BenchmarkResult {
+    size_t lines = 0;
+    PhaseResult firstPass, encode, emit;
+    long peakRssKb = 0;
+};
+
+// Runs fn with allocation counting on and returns its time and heap traffic
+template <typename Fn>
+PhaseResult measurePhase(Fn fn) {
+    allocationStats.bytes = 0;
+    allocationStats.count = 0;
+    allocationStats.enabled = true;
+    auto start = chrono::steady_clock::now();
+    fn();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    allocationStats.enabled = false;
+    return {seconds, allocationStats.bytes, allocationStats.count};
+}
+
+long peakRssKb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+// Times firstPass(), encoding and output emission separately on one source file. Keeps the
+// fastest of the repeats for each phase.
+BenchmarkResult benchmarkAssembler(const string& inputFile, const string& outputFile, int repeats) {
+    BenchmarkResult result;
+    for (int run = 0; run < repeats; run++) {
+        AssemblerContext ctx;
+        SourceFile inFile(inputFile);
+        const Program& program = ctx.program;
+        vector<EncodedLine> encoded;
+
+        PhaseResult first = measurePhase([&] { firstPass(ctx, inFile.text()); });
+        PhaseResult encode = measurePhase([&] {
+            encoded.resize(program.count);
+            for (size_t i = 0; i < program.count; i++) {
+                const IrInstruction& ir = program.instructions[i];
+                string_view line = program.line(ir);
+                ctx.diagnostics.setLine(line, ir.lineNumber);
+                encodeInstruction(ctx.symbols, ctx.diagnostics, ir, line, encoded[i], true);
+            }
+        });
+        PhaseResult emit = measurePhase([&] {
+            OutputWriter outFile(outputFile, ANNOTATED_OUTPUT);
+            for (size_t i = 0; i < program.count; i++) {
+                const IrInstruction& ir = program.instructions[i];
+                if (encoded[i].valid) {
+                    writeEncoded(outFile, ir.address, program.line(ir), encoded[i]);
+                }
+            }
+            outFile.textEnd(program.endAddress);
+            writeDataSegment(ctx, outFile);
+        });
+
+        if (run == 0 || first.seconds < result.firstPass.seconds) {
+            result.firstPass = first;
+        }
+        if (run == 0 || encode.seconds < result.encode.seconds) {
+            result.encode = encode;
+        }
+        if (run == 0 || emit.seconds < result.emit.seconds) {
+            result.emit = emit;
+        }
+        result.lines = program.count;
+    }
+    result.peakRssKb = peakRssKb();
+    return result;
+}
+
+// Flat name=value view of a result, used for printing, saving and comparing
+vector<pair<string, double>> benchmarkMetrics(const BenchmarkResult& result) {
+    vector<pair<string, double>> metrics;
+    auto phase = [&](const string& name, const PhaseResult& p) {
+        metrics.push_back({name + ".lines_per_sec", p.seconds > 0 ? result.lines / p.seconds : 0});
+        metrics.push_back({name + ".ms", p.seconds * 1000});
+        metrics.push_back({name + ".bytes_allocated", (double)p.bytes});
+        metrics.push_back({name + ".allocations", (double)p.allocations});
+    };
+    PhaseResult total = {result.firstPass.seconds + result.encode.seconds + result.emit.seconds,
+                         result.firstPass.bytes + result.encode.bytes + result.emit.bytes,
+                         result.firstPass.allocations + result.encode.allocations + result.emit.allocations};
+    phase("first_pass", result.firstPass);
+    phase("encode", result.encode);
+    phase("emit", result.emit);
+    phase("total", total);
+    metrics.push_back({"peak_rss_kb", (double)result.peakRssKb});
+    return metrics;
+}
+
+// Prints the metrics, with the change against a baseline saved by --bench-save if given
+void printBenchmark(const BenchmarkResult& result, const string& baselineFile) {
+    map<string, double> baseline;
+    if (!baselineFile.empty()) {
+        ifstream in(baselineFile);
+        string name;
+        double value;
+        while (in >> name >> value) {
+            baseline[name] = value;
+        }
+    }
+    cout << "lines: " << result.lines << endl;
+    for (const auto& [name, value] : benchmarkMetrics(result)) {
+        cout << left << setw(28) << name << right << setw(16) << fixed << setprecision(1) << value;
+        auto it = baseline.find(name);
+        if (it != baseline.end() && it->second != 0) {
+            cout << "  (" << showpos << setprecision(1) << (value / it->second - 1) * 100 << noshowpos << "%)";
+        }
+        cout << endl;
+    }
+}
+
+void saveBenchmark(const BenchmarkResult& result, const string& file) {
+    ofstream out(file);
+    for (const auto& [name, value] : benchmarkMetrics(result)) {
+        out << name << " " << setprecision(17) << value << "\n";
+    }
+}
+
+string temporaryPath(const char* suffix) {
+    string path = string("/tmp/phase1_") + to_string(getpid()) + suffix;
+    return path;
+}
+
+// The stoi based parsers the assembler used before parseRegister() and parseInteger(),
+// kept as the baseline for --bench-parsers
+string stoiRegisterToBinary(const string& reg) {
+    try {
+        int regNum = stoi(reg.substr(1));
+        return bitset<5>(regNum < 0 || regNum > 31 ? 0 : regNum).to_string();
+    } catch (const exception&) {
+        return bitset<5>().to_string();
+    }
+}
+
+bitset<12> stoiParseImmediate(const string& imm) {
+    int value = 0;
+    try {
+        if (imm.size() > 2 && imm[0] == '0' && (imm[1] == 'x' || imm[1] == 'X')) {
+            value = stoi(imm.substr(2), nullptr, 16);
+        } else if (imm.size() > 2 && imm[0] == '0' && (imm[1] == 'b' || imm[1] == 'B')) {
+            value = stoi(imm.substr(2), nullptr, 2);
+        } else {
+            value = stoi(imm);
+        }
+    } catch (const exception&) {
+        return bitset<12>();
+    }
+    return bitset<12>(value);
+}
+
+// Microbenchmark of register and immediate parsing, old against new, over a fixed set of
+// operands in the forms the assembler sees
+void benchmarkParsers(size_t iterations) {
+    vector<string> registers, immediates;
+    for (int i = 0; i < 32; i++) {
+        registers.push_back("x" + to_string(i));
+        immediates.push_back(to_string(i * 61 - 900));
+        immediates.push_back("0x" + to_string(i * 13));
+        immediates.push_back(i % 2 ? "0b101101" : "-2048");
+    }
+    vector<string_view> registerViews(registers.begin(), registers.end());
+    vector<string_view> immediateViews(immediates.begin(), immediates.end());
+    Diagnostics diag;
+    uint64_t sink = 0;
+
+    auto time = [&](const char* name, size_t operands, auto body) {
+        allocationStats.count = 0;
+        allocationStats.enabled = true;
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; i++) {
+            body();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        allocationStats.enabled = false;
+        double calls = (double)iterations * operands;
+        cout << left << setw(24) << name << right << fixed << setprecision(2) << setw(10)
+             << seconds * 1e9 / calls << " ns/op" << setw(10) << allocationStats.count / calls << " allocs/op" << endl;
+        return seconds;
+    };
+
+    double oldRegisters = time("registers, stoi", registers.size(), [&] {
+        for (const string& reg : registers) {
+            sink += bitset<5>(stoiRegisterToBinary(reg)).to_ulong();
+        }
+    });
+    double newRegisters = time("registers, parseRegister", registers.size(), [&] {
+        for (string_view reg : registerViews) {
+            sink += registerNumber(diag, reg);
+        }
+    });
+    double oldImmediates = time("immediates, stoi", immediates.size(), [&] {
+        for (const string& imm : immediates) {
+            sink += stoiParseImmediate(imm).to_ulong();
+        }
+    });
+    double newImmediates = time("immediates, parseInteger", immediates.size(), [&] {
+        for (string_view imm : immediateViews) {
+            sink += parseImmediate<12>(diag, imm).to_ulong();
+        }
+    });
+    cout << "speedup: registers " << setprecision(1) << oldRegisters / newRegisters << "x, immediates "
+         << oldImmediates / newImmediates << "x (checksum " << sink << ")" << endl;
+}
+
+// Front end throughput over source: splitting lines, cutting comments and tokenizing,
+// byte at a time against LineScanner with each block classifier the machine supports
+void benchmarkScanner(string_view source, int repeats) {
+    uint64_t sink = 0;
+    auto time = [&](const char* name, auto body) {
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < repeats; i++) {
+            body();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << left << setw(24) << name << right << fixed << setprecision(2) << setw(10)
+             << source.size() * repeats / seconds / 1e9 << " GB/s" << endl;
+    };
+    auto tokenize = [&](string_view line) {
+        while (!nextToken(line).empty()) {
+            sink++;
+        }
+    };
+    time("lines, byte at a time", [&] {
+        string_view text = source, line;
+        while (nextLine(text, line)) {
+            line = stripComment(line);
+            while (!nextTokenScalar(line).empty()) {
+                sink++;
+            }
+        }
+    });
+    vector<pair<const char*, BlockClassifier>> classifiers = {{"lines, scalar blocks", classifyBlockScalar}};
+#if defined(__x86_64__)
+    classifiers.push_back({"lines, sse2 blocks", classifyBlockSse2});
+    if (__builtin_cpu_supports("avx2")) {
+        classifiers.push_back({"lines, avx2 blocks", classifyBlockAvx2});
+    }
+#endif
+    BlockClassifier best = classifyBlock;
+    for (auto [name, classifier] : classifiers) {
+        classifyBlock = classifier;
+        time(name, [&] {
+            LineScanner lines(source);
+            string_view line;
+            while (lines.next(line)) {
+                tokenize(line);
+            }
+        });
+    }
+    classifyBlock = best;
+    cout << "(" << sink / repeats / (classifiers.size() + 1) << " tokens)" << endl;
+}
+
+bool hasSuffix(const string& text, const string& suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Whether target exists and is at least as new as source
+bool upToDate(const string& target, const string& source) {
+    struct stat targetInfo, sourceInfo;
+    if (stat(target.c_str(), &targetInfo) != 0 || stat(source.c_str(), &sourceInfo) != 0) {
+        return false;
+    }
+    return make_pair(targetInfo.st_mtim.tv_sec, targetInfo.st_mtim.tv_nsec) >=
+           make_pair(sourceInfo.st_mtim.tv_sec, sourceInfo.st_mtim.tv_nsec);
+}
+
+// Whether the object at path is at least as new as source and was assembled with the
+// options that give fingerprint
+bool objectUpToDate(const string& path, const string& source, uint64_t fingerprint) {
+    ifstream in(path, ios::binary);
+    uint64_t objectPrint;
+    return upToDate(path, source) && readObjectHeader(in, objectPrint) && objectPrint == fingerprint;
+}
+
+// --link: files are objects, or .asm sources which are assembled to <source>.o unless
+// that is up to date and built with the same options, optionally followed by the output file. Prints every error and
+// returns whether the program was linked.
+bool linkFiles(vector<string> files, AssemblerOptions options, string& outputFile) {
+    outputFile = "output.mc";
+    if (files.size() > 1 && !hasSuffix(files.back(), ".o") && !hasSuffix(files.back(), ".asm")) {
+        outputFile = files.back();
+        files.pop_back();
+    }
+    options.object = true;
+    vector<string> objects;
+    bool ok = true;
+    for (const string& file : files) {
+        if (!hasSuffix(file, ".asm")) {
+            objects.push_back(file);
+            continue;
+        }
+        string object = file.substr(0, file.size() - 4) + ".o";
+        objects.push_back(object);
+        if (objectUpToDate(object, file, objectFingerprint(options.optimize))) {
+            continue;
+        }
+        AssemblerContext ctx;
+        if (!assembleFile(ctx, file, object, options)) {
+            for (const Diagnostic& diagnostic : ctx.diagnostics.entries) {
+                cerr << formatDiagnostic(diagnostic) << endl;
+            }
+            ok = false;
+        }
+    }
+    if (!ok) {
+        return false;
+    }
+    Diagnostics diag;
+    ok = linkObjects(objects, outputFile, options.mode, diag);
+    for (const Diagnostic& diagnostic : diag.entries) {
+        cerr << formatDiagnostic(diagnostic) << endl;
+    }
+    return ok;
+}
+
+// Text labels of an assembled program for the --pipeline report
+LabelList textLabels(const AssemblerContext& ctx) {
+    LabelList labels;
+    for (size_t id = 0; id < ctx.symbols.size(); id++) {
+        const Symbol& symbol = ctx.symbols[id];
+        if (symbol.defined && symbol.address < DATA_BASE && !symbol.name.empty() && symbol.name[0] != ' ') {
+            labels.emplace_back(symbol.address, string(symbol.name));
+        }
+    }
+    sort(labels.begin(), labels.end());
+    return labels;
+}
+
+int main(int argc, char* argv[]) {
+    AssemblerOptions options;
+    bool parallel = false;
+    bool link = false;
+    string batchList;
+    string socketPath;
+    string simulateImage;
+    string disassembleImage;
+    bool roundTrip = false;
+    uint64_t randomWords = 1000000;
+    bool run = false;
+    uint64_t maxSteps = UINT64_MAX;
+    PipelineConfig pipelineConfig;
+    const PipelineConfig* pipeline = nullptr;
+    unsigned threadCount = thread::hardware_concurrency();
+    WorkloadOptions workload;
+    string generateFile;
+    bool bench = false;
+    int benchRepeats = 3;
+    string benchSave, benchCompare;
+    bool benchParsers = false;
+    bool stats = false;
+    string statsJson;
+    vector<string> files;
+    string usage;   // the first usage error, reported once the arguments are read
+    auto usageError = [&](const string& message) {
+        if (usage.empty()) {
+            usage = message;
+        }
+    };
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        // The value of an option that takes one, empty after reporting it missing
+        auto value = [&]() -> string {
+            if (i + 1 >= argc) {
+                usageError(arg + " needs a value");
+                return "";
+            }
+            return argv[++i];
+        };
+        auto number = [&](auto& target) {
+            string text = value();
+            if (!text.empty() && !parseNumber(text, target)) {
+                usageError(arg + " takes a number, not " + text);
+            }
+        };
+        if (arg == "--one-pass") {
+            options.onePass = true;
+        } else if (arg == "--optimize") {
+            options.optimize = true;
+        } else if (arg == "--object") {
+            options.object = true;
+        } else if (arg == "--link") {
+            link = true;
+        } else if (arg == "--incremental") {
+            options.incremental = true;
+        } else if (arg == "--compact") {
+            options.mode = COMPACT_OUTPUT;
+        } else if (arg == "--binary") {
+            options.mode = BINARY_OUTPUT;
+        } else if (arg == "--parallel") {
+            parallel = true;
+        } else if (arg == "--run") {
+            run = true;
+        } else if (arg == "--simulate") {
+            simulateImage = value();
+        } else if (arg == "--disassemble") {
+            disassembleImage = value();
+        } else if (arg == "--round-trip") {
+            roundTrip = true;
+        } else if (arg == "--random-words") {
+            number(randomWords);
+        } else if (arg == "--pipeline") {
+            pipeline = &pipelineConfig;
+            run = true;
+        } else if (arg == "--no-forwarding") {
+            pipelineConfig.forwarding = false;
+        } else if (arg == "--predictor") {
+            string name = value();
+            auto kind = find(begin(predictorNames), end(predictorNames), name);
+            if (kind == end(predictorNames)) {
+                usageError("unknown branch predictor " + name + " (static, 1bit, 2bit or btb)");
+            } else {
+                pipelineConfig.predictor = (PredictorKind)(kind - begin(predictorNames));
+            }
+        } else if (arg == "--max-steps") {
+            number(maxSteps);
+        } else if (arg == "--batch") {
+            batchList = value();
+        } else if (arg == "--serve") {
+            socketPath = value();
+        } else if (arg == "--jobs") {
+            number(threadCount);
+        } else if (arg == "--generate") {
+            generateFile = value();
+        } else if (arg == "--stats") {
+            stats = true;
+        } else if (arg == "--stats-json") {
+            statsJson = value();
+        } else if (arg == "--bench-parsers") {
+            benchParsers = true;
+        } else if (arg == "--bench") {
+            bench = true;
+        } else if (arg == "--repeat") {
+            number(benchRepeats);
+            benchRepeats = max(1, benchRepeats);
+        } else if (arg == "--bench-save") {
+            benchSave = value();
+        } else if (arg == "--bench-compare") {
+            benchCompare = value();
+        } else if (arg == "--seed") {
+            number(workload.seed);
+        } else if (arg == "--lines") {
+            number(workload.lines);
+        } else if (arg == "--mix") {
+            string text = value();
+            string_view mix = text;
+            for (double& weight : workload.mix) {
+                size_t comma = mix.find(',');
+                if (!parseNumber(mix.substr(0, comma), weight) || weight < 0) {
+                    usageError("--mix takes six weights separated by commas, not " + text);
+                    break;
+                }
+                mix = comma == string_view::npos ? string_view() : mix.substr(comma + 1);
+            }
+        } else if (arg == "--label-density") {
+            number(workload.labelDensity);
+        } else if (arg == "--branch-distance") {
+            number(workload.branchDistance);
+            workload.branchDistance = max(1, workload.branchDistance);
+        } else if (arg == "--data-ratio") {
+            number(workload.dataRatio);
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            usageError("unknown option " + arg + ", README.md lists the options");
+        } else {
+            files.push_back(arg);
+        }
+    }
+    if (!usage.empty()) {
+        cerr << "error: " << usage << endl;
+        return 1;
+    }
+
+    // These modes encode line by line as they go, or patch words after encoding, so they
+    // have nothing to split up
+    if (parallel && (options.incremental || options.onePass || options.object || link)) {
+        const char* other = options.incremental ? "--incremental"
+                            : options.onePass   ? "--one-pass"
+                            : options.object    ? "--object"
+                                                : "--link";
+        cerr << "error: --parallel cannot be combined with " << other << endl;
+        return 1;
+    }
+    // The optimizer rewrites the IR between the passes, and --one-pass encodes each line
+    // as it is read
+    if (options.optimize && options.onePass) {
+        cerr << "error: --optimize cannot be combined with --one-pass" << endl;
+        return 1;
+    }
+    // --serve assembles every request with the two passes into a --compact listing in
+    // memory, so options for other modes or for a single run have nothing to act on
+    if (!socketPath.empty()) {
+        pair<bool, const char*> others[] = {
+            {parallel, "--parallel"}, {stats, "--stats"}, {!statsJson.empty(), "--stats-json"},
+            {options.incremental, "--incremental"}, {options.onePass, "--one-pass"},
+            {options.object, "--object"}, {link, "--link"}, {run, "--run"}, {!batchList.empty(), "--batch"},
+        };
+        for (auto [given, other] : others) {
+            if (given) {
+                cerr << "error: --serve cannot be combined with " << other << endl;
+                return 1;
+            }
+        }
+    }
+
+    if (!generateFile.empty()) {
+        return writeFile(generateFile, generateWorkload(workload)) ? 0 : 1;
+    }
+    if (benchParsers) {
+        benchmarkParsers(200000);
+        string source = generateWorkload(workload);
+        benchmarkScanner(source, benchRepeats);
+        return 0;
+    }
+    if (bench) {
+        // Without an input file the benchmark generates one from the workload options
+        string inputFile = files.empty() ? temporaryPath(".asm") : files[0];
+        string outputFile = temporaryPath(".mc");
+        if (files.empty()) {
+            writeFile(inputFile, generateWorkload(workload));
+        }
+        BenchmarkResult result = benchmarkAssembler(inputFile, outputFile, benchRepeats);
+        printBenchmark(result, benchCompare);
+        if (!benchSave.empty()) {
+            saveBenchmark(result, benchSave);
+        }
+        if (files.empty()) {
+            unlink(inputFile.c_str());
+        }
+        unlink(outputFile.c_str());
+        return 0;
+    }
+    if (!simulateImage.empty()) {
+        return simulateProgram(simulateImage, maxSteps, pipeline) ? 0 : 1;
+    }
+    if (!disassembleImage.empty()) {
+        return disassembleProgram(disassembleImage) ? 0 : 1;
+    }
+    if (roundTrip) {
+        return roundTripEncoders(randomWords, workload.seed) ? 0 : 1;
+    }
+
+    AssemblerStats assemblerStats;
+    if (stats || !statsJson.empty()) {
+        options.stats = &assemblerStats;
+        allocationStats.enabled = true;
+    }
+    // Called once the assembly is done, whether it succeeded or not
+    auto reportStats = [&]() {
+        if (options.stats == nullptr) {
+            return;
+        }
+        allocationStats.enabled = false;
+        assemblerStats.allocations = allocationStats.count;
+        assemblerStats.allocationBytes = allocationStats.bytes;
+        if (stats) {
+            printStats(assemblerStats, cout);
+        }
+        if (!statsJson.empty()) {
+            ofstream out(statsJson);
+            writeStatsJson(assemblerStats, out);
+        }
+    };
+
+    if (!socketPath.empty()) {
+        return serve(socketPath, options, threadCount) ? 0 : 1;
+    }
+    if (!batchList.empty()) {
+        vector<BatchJob> jobs;
+        if (!readBatchList(batchList, jobs)) {
+            cerr << batchList << ": error: Cannot open " << batchList << endl;
+            return 1;
+        }
+        size_t failures = assembleBatch(jobs, options, parallel, threadCount);
+        reportStats();
+        return failures == 0 ? 0 : 1;
+    }
+
+    if (link) {
+        string outputFile;
+        bool ok = linkFiles(files, options, outputFile);
+        reportStats();
+        if (!ok) {
+            return 1;
+        }
+        cout << "Link complete. Check " << outputFile << endl;
+        return run ? (simulateProgram(outputFile, maxSteps, pipeline) ? 0 : 1) : 0;
+    }
+
+    string inputFile = files.size() > 0 ? files[0] : "input.asm";
+    string outputFile = files.size() > 1 ? files[1] : "output.mc";
+    if (options.object && files.size() < 2) {
+        outputFile = (hasSuffix(inputFile, ".asm") ? inputFile.substr(0, inputFile.size() - 4) : inputFile) + ".o";
+    }
+    AssemblerContext ctx;
+    unique_ptr<WorkStealingPool> pool;
+    if (parallel) {
+        pool = make_unique<WorkStealingPool>(threadCount);
+        options.pool = pool.get();
+    }
+    bool ok = assembleFile(ctx, inputFile, outputFile, options);
+    for (const Diagnostic& diagnostic : ctx.diagnostics.entries) {
+        cerr << formatDiagnostic(diagnostic) << endl;
+    }
+    reportStats();
+    if (!ok) {
+        return 1;
+    }
+    cout << "Assembly translation complete. Check " << outputFile << endl;
+    if (run && !options.object) {
+        return simulateProgram(outputFile, maxSteps, pipeline, textLabels(ctx)) ? 0 : 1;
+    }
     return 0;
 }
@@ -0,0 +1,14 @@
+# A label defined twice is an error in both assemblers; uses before and after the second
+# definition resolve to the first one
+loop:
+addi x5 x5 -1
+bne x5 x0 loop
+jal x0 end
+loop: addi x6 x6 1
+beq x6 x0 loop
+end:
+addi x7 x0 1
+end: add x7 x7 x7
+.data
+value: .word 2
+value: .byte 3
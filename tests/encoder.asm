@@ -0,0 +1,57 @@
+# Every instruction in the table, with the smallest and largest immediates of its format
+# and both operand forms of loads, stores and jalr
+.text
+start:
+add x1, x2, x3
+sub x31, x0, x17
+and x5 x6 x7
+or x8, x9, x10
+sll x11, x12, x13
+slt x14, x15, x16
+sra x17, x18, x19
+srl x20, x21, x22
+xor x23, x24, x25
+mul x26, x27, x28
+div x29, x30, x31
+rem x1, x31, x16
+addi x1, x2, -2048
+addi x3 x4 2047
+addi x5 x0 0
+andi x6, x7, 0x7ff
+ori x8, x9, -1
+ori x10 x11 0b10101010101
+jalr x1, x2, 0
+jalr x0, 8(x1)
+jalr x31 x30 -2048
+lb x1, -2048(x2)
+lb x3 2047 x4
+ld x5, 0(x6)
+lh x7, -1(x8)
+lw x9 100 x10
+sb x1, -2048(x2)
+sh x3, 2047(x4)
+sw x5 -1 x6
+sd x31, 8(x0)
+middle:
+beq x1, x2, start
+bne x3 x4 middle
+bge x5, x6, end
+blt x7, x8, -4096
+beq x0 x0 4094
+bne x9 x10 0
+auipc x1, 0
+auipc x31 0xfffff
+lui x5, 1048575
+lui x6 0b1
+jal x1, start
+jal x0 end
+jal x5 -1048576
+jal x6 1048574
+end:
+add x0 x0 x0
+.data
+bytes: .byte -128 127 0x7f
+halves: .half -32768 32767
+words: .word -2147483648 0x7fffffff 0b1
+dwords: .dword -1 0x01234567
+text: .asciz "encoder"
@@ -0,0 +1,50 @@
+.text
+add x1 x2 x3 # 0x0 0x003100b3
+sub x31 x0 x17 # 0x4 0x41100fb3
+and x5 x6 x7 # 0x8 0x007372b3
+or x8 x9 x10 # 0xc 0x00a4e433
+sll x11 x12 x13 # 0x10 0x00d615b3
+slt x14 x15 x16 # 0x14 0x0107a733
+sra x17 x18 x19 # 0x18 0x413958b3
+srl x20 x21 x22 # 0x1c 0x016ada33
+xor x23 x24 x25 # 0x20 0x019c4bb3
+mul x26 x27 x28 # 0x24 0x03cd8d33
+div x29 x30 x31 # 0x28 0x03ff4eb3
+rem x1 x31 x16 # 0x2c 0x030fe0b3
+addi x1 x2 -2048 # 0x30 0x80010093
+addi x3 x4 2047 # 0x34 0x7ff20193
+addi x5 x0 0 # 0x38 0x00000293
+andi x6 x7 2047 # 0x3c 0x7ff3f313
+ori x8 x9 -1 # 0x40 0xfff4e413
+ori x10 x11 1365 # 0x44 0x5555e513
+jalr x1 x2 0 # 0x48 0x000100e7
+jalr x0 x1 8 # 0x4c 0x00808067
+jalr x31 x30 -2048 # 0x50 0x800f0fe7
+lb x1 -2048 x2 # 0x54 0x80010083
+lb x3 2047 x4 # 0x58 0x7ff20183
+ld x5 0 x6 # 0x5c 0x00033283
+lh x7 -1 x8 # 0x60 0xfff41383
+lw x9 100 x10 # 0x64 0x06452483
+sb x1 -2048 x2 # 0x68 0x80110023
+sh x3 2047 x4 # 0x6c 0x7e321fa3
+sw x5 -1 x6 # 0x70 0xfe532fa3
+sd x31 8 x0 # 0x74 0x01f03423
+beq x1 x2 -120 # 0x78 0xf82084e3
+bne x3 x4 -4 # 0x7c 0xfe419ee3
+bge x5 x6 48 # 0x80 0x0262d863
+blt x7 x8 -4096 # 0x84 0x8083c063
+beq x0 x0 4092 # 0x88 0x7e000ee3
+bne x9 x10 0 # 0x8c 0x00a49063
+auipc x1 0 # 0x90 0x00000097
+auipc x31 1048575 # 0x94 0xffffff97
+lui x5 1048575 # 0x98 0xfffff2b7
+lui x6 1 # 0x9c 0x00001337
+jal x1 -160 # 0xa0 0xf61ff0ef
+jal x0 12 # 0xa4 0x00c0006f
+jal x5 -1048576 # 0xa8 0x800002ef
+jal x6 1048572 # 0xac 0x7fdff36f
+add x0 x0 x0 # 0xb0 0x00000033
+.data
+data0: .byte 128 127 127 0 128 255 127 0 0 0 128 255 255 255 127 1
+data16: .byte 0 0 0 255 255 255 255 255 255 255 255 103 69 35 1 0
+data32: .byte 0 0 0 101 110 99 111 100 101 114 0
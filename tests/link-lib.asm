@@ -0,0 +1,20 @@
+# sum: adds the x11 words at x10 into x12 and stores the result in total. end is the
+# end of the program.
+.data
+total: .word 0
+.text
+.globl sum
+.globl total
+.globl end
+sum:
+addi x12 x0 0
+next:
+lw x13 0(x10)
+add x12 x12 x13
+addi x10 x10 4
+addi x11 x11 -1
+bne x11 x0 next
+la x5 total
+sw x12 0(x5)
+jalr x0 0(x1)
+end:
@@ -0,0 +1,13 @@
+# Calls sum in link-lib.asm on its table, loads the result back from there and jumps
+# to end, past the code of link-lib.asm
+.data
+values: .word 4 5 6
+.text
+.globl main
+main:
+la x10 values
+addi x11 x0 3
+jal x1 sum
+la x6 total
+lw x7 0(x6)
+jal x0 end
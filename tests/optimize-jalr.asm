@@ -0,0 +1,13 @@
+# Code --optimize must leave alone: skip returns past an inline word with a jalr offset,
+# and a jump through a register loaded from memory. Removing the no-ops would move the
+# code these jalr reach.
+jal x1 skip
+addi x0 x0 0
+addi x5 x5 1
+jal x0 tail
+skip:
+add x6 x6 x0
+jalr x0 8(x1)
+tail:
+lw x7 0(x2)
+jalr x0 0(x7)
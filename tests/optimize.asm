@@ -0,0 +1,16 @@
+# Peephole cases for --optimize: no-ops, an addi chain with a load in between, a jump to
+# a jump, a branch to the next instruction and a numeric backward branch
+start:
+addi x0 x5 3
+add x5 x5 x0
+addi x2 x2 -8
+lw x5 4(x2)
+addi x2 x2 8
+beq x5 x0 next
+next:
+jal x0 hop
+addi x6 x6 1
+hop:
+jal x0 start
+and x7 x7 x7
+bne x5 x6 -8
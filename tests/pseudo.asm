@@ -0,0 +1,22 @@
+# Pseudo-instructions, ABI register names and the shortest li sequences
+.data
+message: .asciz "hi"
+.text
+main:
+li a0 0
+li a1 -2048
+li a2 2047
+li a3 0x12345000
+li a4 0x12345678
+li a5 -0x80000000
+li a6 0x7FFFFFFF
+la t0 message
+la t1 main
+mv s0 sp
+call helper
+j done
+helper:
+addi fp fp 1
+ret
+done:
+mv zero ra
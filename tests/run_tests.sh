@@ -0,0 +1,264 @@
+#!/bin/sh
+# Regression tests: assembles the sample programs and the sources in tests/ in each mode
+# and compares what comes out byte for byte against tests/golden.
+#
+#   tests/run_tests.sh [phase1 binary]     (make test builds ./phase1 and runs this)
+#
+# With UPDATE=1 the golden files are rewritten from the current output instead; check the
+# diff before committing them.
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+phase1=${1:-$root/phase1}
+case $phase1 in
+    /*) ;;
+    *) phase1=$PWD/$phase1 ;;
+esac
+golden=$root/tests/golden
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cp "$root"/*.asm "$root"/tests/*.asm "$work"
+passed=0
+failed=0
+
+fail() {
+    echo "FAIL $1"
+    failed=$((failed + 1))
+}
+
+# run <name> <exit status> <arguments...>: runs phase1 in the work directory, with its
+# stdout and stderr kept in <name>.out and <name>.err there
+run() {
+    name=$1
+    status=$2
+    shift 2
+    (cd "$work" && "$phase1" "$@" >"$name.out" 2>"$name.err")
+    actual=$?
+    if [ "$actual" -ne "$status" ]; then
+        fail "$name: exit status $actual, expected $status"
+        sed 's/^/    /' "$work/$name.err"
+        return 1
+    fi
+    passed=$((passed + 1))
+}
+
+# expect <name> <golden file> <file in the work directory>
+expect() {
+    if [ -n "${UPDATE:-}" ]; then
+        cp "$work/$3" "$golden/$2"
+    fi
+    if cmp -s "$golden/$2" "$work/$3"; then
+        passed=$((passed + 1))
+    else
+        fail "$1: $3 differs from tests/golden/$2"
+        diff "$golden/$2" "$work/$3" | head -n 20 | sed 's/^/    /'
+    fi
+}
+
+# same <name> <file> <file>: two outputs of the work directory that must be identical
+same() {
+    if cmp -s "$work/$2" "$work/$3"; then
+        passed=$((passed + 1))
+    else
+        fail "$1: $3 differs from $2"
+        diff "$work/$2" "$work/$3" | head -n 20 | sed 's/^/    /'
+    fi
+}
+
+# Encoders: every instruction at the ends of its immediate range, and the sample programs
+for source in encoder input fibonacci test1; do
+    run "$source" 0 "$source.asm" "$source.mc" && expect "$source" "$source.mc" "$source.mc"
+done
+run compact 0 --compact encoder.asm compact.mc && expect compact encoder-compact.mc compact.mc
+run binary 0 --binary encoder.asm binary.bin && expect binary encoder.bin binary.bin
+run test2 1 test2.asm test2.mc && expect test2 test2.err test2.err
+
+# An output file that cannot be created fails the assembly in every mode, and so does
+# one whose writes fail where the system has a /dev/full to try that
+for mode in "" --one-pass --incremental --parallel; do
+    run "unwritable$mode" 1 $mode fibonacci.asm missing/output.mc && expect unwritable unwritable.err "unwritable$mode.err"
+done
+if [ -w /dev/full ]; then
+    run full 1 fibonacci.asm /dev/full
+fi
+
+# Sources that end mid-block without a newline, in a token and in a comment: the
+# scanner classifies the last partial block and the tokenizer the last bytes on their own
+printf 'addi x5 x0 1 # 64-byte block one\nadd x6 x5 x5\t\t#\naddi x7 x6 -2047\n  add x9 x7 x7' >"$work/tail.asm"
+printf 'addi x5 x0 1\nadd x6 x5 x5   #tail' >"$work/tail-comment.asm"
+for source in tail tail-comment; do
+    run "$source" 0 --compact "$source.asm" "$source.mc" && expect "$source" "$source.mc" "$source.mc"
+    run "$source-one-pass" 0 --compact --one-pass "$source.asm" "$source-one-pass.mc" &&
+        same "$source-one-pass" "$source.mc" "$source-one-pass.mc"
+done
+
+# --one-pass has to give the two-pass output byte for byte, errors included
+for source in encoder input fibonacci test1; do
+    run "one-pass-$source" 0 --one-pass "$source.asm" "one-pass-$source.mc" &&
+        expect "one-pass-$source" "$source.mc" "one-pass-$source.mc"
+done
+for mode in "" --one-pass; do
+    run "duplicate$mode" 1 $mode duplicate.asm "duplicate$mode.mc" &&
+        expect "duplicate$mode" duplicate.mc "duplicate$mode.mc" &&
+        expect "duplicate$mode" duplicate.err "duplicate$mode.err"
+done
+
+# --parallel splits the text into chunks of at least 2048 lines, so a generated program
+# is needed to get several of them
+run generate 0 --generate generated.asm --lines 50000 --seed 7
+run serial 0 generated.asm serial.mc
+run parallel 0 --parallel --jobs 4 generated.asm parallel.mc && same parallel serial.mc parallel.mc
+run parallel-encoder 0 --parallel encoder.asm parallel-encoder.mc &&
+    expect parallel-encoder encoder.mc parallel-encoder.mc
+
+# --batch: a list with and without output names, and a list that does not exist
+printf 'fibonacci.asm batch-fibonacci.mc\ninput.asm   # default output\n' >"$work/batch.list"
+rm -f "$work/input.mc"
+run batch 0 --batch batch.list && expect batch fibonacci.mc batch-fibonacci.mc && expect batch input.mc input.mc
+run batch-missing 1 --batch missing.list && expect batch-missing batch-missing.err batch-missing.err
+
+# Simulator: the registers a run leaves behind, without the timing line
+run simulate 0 --run sum.asm sum.mc && grep -v '^Executed' "$work/simulate.out" >"$work/simulate.regs" &&
+    expect simulate sum.regs simulate.regs
+
+# --stats: every phase is reported, times aside
+run stats 0 --stats fibonacci.asm stats.mc &&
+    awk '/^  [a-z_]+ +[0-9.]+/ { print $1 }' "$work/stats.out" >"$work/stats.phases" &&
+    expect stats stats.phases stats.phases
+
+# --incremental: a cold cache, a warm one, and an edit that moves the labels after it
+run incremental-cold 0 --incremental fibonacci.asm incremental.mc &&
+    expect incremental-cold fibonacci.mc incremental.mc
+run incremental-warm 0 --incremental fibonacci.asm incremental.mc &&
+    expect incremental-warm fibonacci.mc incremental.mc
+sed '10a\
+addi x5 x5 0' "$work/fibonacci.asm" >"$work/edited.asm"
+run edited 0 edited.asm edited.mc
+cp "$work/incremental.mc.cache" "$work/edited-incremental.mc.cache"
+run incremental-edited 0 --incremental edited.asm edited-incremental.mc &&
+    same incremental-edited edited.mc edited-incremental.mc
+
+# Pseudo-instructions, and the registers they leave behind
+run pseudo 0 --run pseudo.asm pseudo.mc && expect pseudo pseudo.mc pseudo.mc &&
+    grep -v '^Executed' "$work/pseudo.out" >"$work/pseudo.regs" && expect pseudo pseudo.regs pseudo.regs
+
+# far <file> <directive>: x6 holds a value across a branch relaxed over a jal (past 4 KiB)
+# and a branch and a j past the 1 MiB reach of jal, which need the .scratch register
+far() {
+    awk -v directive="$2" 'BEGIN {
+        if (directive != "") print directive
+        print "addi x6 x0 7"; print "bge x0 x6 near"; print "beq x0 x0 far"; print "j far"
+        for (i = 0; i < 2000; i++) print "add x7 x7 x7"
+        print "near:"
+        for (i = 0; i < 270000; i++) print "add x7 x7 x7"
+        print "far:"; print "addi x5 x0 1"
+    }' >"$work/$1"
+}
+far far.asm ""
+far far-t1.asm ".scratch t1"
+far far-x31.asm ".scratch x31"
+run far 1 --compact far.asm far.mc
+run far-t1 1 --compact far-t1.asm far-t1.mc
+cat "$work/far.err" "$work/far-t1.err" >"$work/far-errors.err"
+expect far far.err far-errors.err
+run far-x31 0 --compact --run far-x31.asm far-x31.mc &&
+    head -n 8 "$work/far-x31.mc" >"$work/far-x31.head" && expect far-x31 far-x31.head far-x31.head &&
+    grep -v '^Executed' "$work/far-x31.out" >"$work/far-x31.regs" && expect far-x31 far-x31.regs far-x31.regs
+
+# --optimize: the peephole cases, and a program that must compute the same with and
+# without it
+run optimize 0 --optimize optimize.asm optimize.mc && expect optimize optimize.mc optimize.mc
+run optimize-run 0 --optimize --run sum.asm optimized-sum.mc &&
+    grep -v '^Executed' "$work/optimize-run.out" | sed 's/optimized-sum/sum/' >"$work/optimize-run.regs" &&
+    expect optimize-run sum.regs optimize-run.regs
+run optimize-jalr 0 --optimize optimize-jalr.asm optimize-jalr.mc &&
+    run plain-jalr 0 optimize-jalr.asm plain-jalr.mc && same optimize-jalr plain-jalr.mc optimize-jalr.mc
+run optimize-one-pass 1 --optimize --one-pass sum.asm optimize-one-pass.mc &&
+    expect optimize-one-pass optimize-one-pass.err optimize-one-pass.err
+
+# Disassembler: a listing and a binary image give the same source, which assembles back
+# to the same words; --round-trip checks every encoder the same way
+run disassemble 0 --disassemble compact.mc && cp "$work/disassemble.out" "$work/disassembled.asm" &&
+    expect disassemble disassembled.asm disassembled.asm
+run disassemble-binary 0 --disassemble binary.bin && same disassemble-binary disassemble.out disassemble-binary.out
+run reassemble 0 --compact disassembled.asm reassembled.mc && same reassemble compact.mc reassembled.mc
+run round-trip 0 --round-trip --random-words 100000
+
+# --object and --link: a call, a jump and la of data across two modules. Relinking with
+# --optimize reassembles the objects even though they are newer than their sources.
+run link 0 --link --run --max-steps 1000 link-main.asm link-lib.asm link.mc &&
+    expect link link.mc link.mc &&
+    grep -v '^Executed' "$work/link.out" >"$work/link.regs" && expect link link.regs link.regs
+cp "$work/link-main.o" "$work/link-main-plain.o"
+run link-optimize 0 --link --optimize link-main.asm link-lib.asm link-optimize.mc &&
+    same link-optimize link.mc link-optimize.mc
+if cmp -s "$work/link-main.o" "$work/link-main-plain.o"; then
+    fail "link-optimize: link-main.o was not reassembled"
+else
+    passed=$((passed + 1))
+fi
+# Output that cannot be written is an error about the file, not about a source line
+run object-unwritable 1 --object fibonacci.asm missing/fibonacci.o
+run link-unwritable 1 --link link-main.o link-lib.o missing/link.mc
+cat "$work/object-unwritable.err" "$work/link-unwritable.err" >"$work/object-unwritable-all.err"
+expect object-unwritable object-unwritable.err object-unwritable-all.err
+
+# --serve leaves a file that is not a socket alone
+run serve-regular-file 1 --serve fibonacci.asm
+cmp -s "$root/fibonacci.asm" "$work/fibonacci.asm" || fail "serve-regular-file: fibonacci.asm was replaced"
+# and refuses options it would have nothing to do with
+for mode in --parallel --stats --incremental --one-pass --object; do
+    run "serve$mode" 1 --serve unused.sock $mode
+    [ ! -e "$work/unused.sock" ] || fail "serve$mode: unused.sock was created"
+done
+
+# A client that stays silent must not hold up another with one worker. The second
+# client sends a snippet, one that uses a label only the first defined (the worker's
+# reused context must not remember it), a FILE inside and one outside the directory, then
+# an oversized SOURCE, which ends the connection. Needs python3 for the client.
+if command -v python3 >/dev/null; then
+    (cd "$work" && exec "$phase1" --serve serve.sock --jobs 1 >serve-server.out 2>&1) &
+    server=$!
+    (cd "$work" && timeout 10 python3 - >serve.out 2>&1) <<'CLIENT'
+import os, socket, time
+for _ in range(100):
+    if os.path.exists("serve.sock"):
+        break
+    time.sleep(0.05)
+def connect():
+    client = socket.socket(socket.AF_UNIX)
+    client.connect("serve.sock")
+    return client
+idle = connect()
+idle.sendall(b"SOURCE 100\naddi")
+client = connect()
+source = b"foo: addi x1 x0 5\nadd x2 x1 x1\n"
+requests = b"SOURCE %d\n" % len(source) + source + b"SOURCE 6\nj foo\n"
+client.sendall(requests + b"FILE sum.asm\nFILE /etc/passwd\nSOURCE 999999999999\n")
+client.shutdown(socket.SHUT_WR)
+reply = b""
+while True:
+    data = client.recv(65536)
+    if not data:
+        break
+    reply += data
+print(reply.decode().replace(os.getcwd(), "<work>"), end="")
+CLIENT
+    kill "$server"
+    expect serve serve.out serve.out
+fi
+
+# Modes that cannot be split up refuse --parallel
+for mode in --incremental --one-pass --object --link; do
+    run "parallel$mode" 1 --parallel $mode fibonacci.asm unused.mc
+done
+
+# Usage errors are reported before anything runs
+run unknown-option 1 --bogus fibonacci.asm unused.mc
+run bad-number 1 --jobs many fibonacci.asm unused.mc
+run missing-value 1 fibonacci.asm --max-steps
+cat "$work/unknown-option.err" "$work/bad-number.err" "$work/missing-value.err" >"$work/usage.err"
+expect usage usage.err usage.err
+[ ! -e "$work/unused.mc" ] || fail "usage errors: unused.mc was written"
+
+echo "$passed passed, $failed failed"
+[ "$failed" -eq 0 ]
@@ -0,0 +1,18 @@
+# Sums a table of words, keeping the running sum in a stack slot below sp, so stores and
+# loads with negative offsets go through the simulator
+.data
+table: .word 5 -3 10 200 -7
+.text
+lui x10 0x10000
+addi x11 x0 5
+addi x12 x0 0
+loop:
+lw x13 0 x10
+add x12 x12 x13
+sw x12 -8 x2
+lw x14 -8(x2)
+addi x10 x10 4
+addi x11 x11 -1
+bne x11 x0 loop
+sd x14 -2048(x2)
+ld x15 -2048 x2